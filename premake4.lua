@@ -1,3 +1,8 @@
+newoption {
+    trigger = 'coroutine',
+    description = 'Build the tests of the coroutine header (requires C++20)'
+}
+
 solution 'coyote'
     configurations {'Release', 'Debug'}
     location 'build'
@@ -7,6 +12,7 @@ solution 'coyote'
         description = "Install the library",
         execute = function ()
             os.copyfile('source/coyote.hpp', '/usr/local/include/coyote.hpp')
+            os.copyfile('source/coyoteCoroutine.hpp', '/usr/local/include/coyoteCoroutine.hpp')
 
             print(string.char(27) .. '[32mCoyote library installed.' .. string.char(27) .. '[0m')
             os.exit()
@@ -18,6 +24,7 @@ solution 'coyote'
         description = 'Remove all the files installed during build processes',
         execute = function ()
             os.execute('rm -f /usr/local/include/coyote.hpp')
+            os.execute('rm -f /usr/local/include/coyoteCoroutine.hpp')
             print(string.char(27) .. '[32mCoyote library uninstalled.' .. string.char(27) .. '[0m')
             os.exit()
         end
@@ -28,7 +35,7 @@ solution 'coyote'
         kind 'ConsoleApp'
         language 'C++'
         location 'build'
-        files {'source/coyote.hpp', 'test/**.hpp', 'test/**.cpp'}
+        files {'source/coyote.hpp', 'test/*.hpp', 'test/*.cpp'}
 
         -- Define the include paths
         includedirs {'/usr/local/include'}
@@ -50,7 +57,7 @@ solution 'coyote'
         -- Linux specific settings
         configuration 'linux'
             buildoptions {'-std=c++11'}
-            linkoptions {'-std=c++11'}
+            linkoptions {'-std=c++11', '-pthread'}
             postbuildcommands {'cp ../source/coyote.hpp /usr/local/include/coyote.hpp'}
 
         -- Mac OS X specific settings
@@ -59,6 +66,43 @@ solution 'coyote'
             linkoptions {'-std=c++11', '-stdlib=libc++'}
             postbuildcommands {'cp ../source/coyote.hpp /usr/local/include/coyote.hpp'}
 
+    -- The coroutine tests require a C++20 compiler
+    if _OPTIONS['coroutine'] then
+        project 'coyoteCoroutineTest'
+            -- General settings
+            kind 'ConsoleApp'
+            language 'C++'
+            location 'build'
+            files {'source/coyote.hpp', 'source/coyoteCoroutine.hpp', 'test/*.hpp', 'test/catch.cpp', 'test/coroutine/**.cpp'}
+
+            -- Define the include paths
+            includedirs {'/usr/local/include'}
+            libdirs {'/usr/local/lib'}
+
+            -- Link the dependencies
+            links {'usb-1.0'}
+
+            -- Declare the configurations
+            configuration 'Release'
+                targetdir 'build/Release'
+                defines {'NDEBUG'}
+                flags {'OptimizeSpeed'}
+            configuration 'Debug'
+                targetdir 'build/Debug'
+                defines {'DEBUG'}
+                flags {'Symbols'}
+
+            -- Linux specific settings
+            configuration 'linux'
+                buildoptions {'-std=c++20'}
+                linkoptions {'-std=c++20', '-pthread'}
+
+            -- Mac OS X specific settings
+            configuration 'macosx'
+                buildoptions {'-std=c++20', '-stdlib=libc++'}
+                linkoptions {'-std=c++20', '-stdlib=libc++'}
+    end
+
     project 'changeId'
         -- General settings
         kind 'ConsoleApp'
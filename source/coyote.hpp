@@ -4,334 +4,4235 @@
 
 #include <stdexcept>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <vector>
+#include <utility>
 #include <string>
 #include <iterator>
+#include <functional>
+#include <algorithm>
 #include <cstdlib>
-#ifdef __APPLE__
-    #include <unistd.h>
+#include <limits>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <deque>
+#include <exception>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <linux/usbdevice_fs.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #endif
 
 /// coyote is a communication library for the FT232H chip.
 namespace coyote {
 
-    /// Chip represents a FT232H chip.
-    class Chip {
+    /// Statistics is a snapshot of a chip's counters.
+    /// The counters are updated with relaxed atomic operations: a snapshot taken while transfers are running may mix values from consecutive transfers.
+    struct Statistics {
+        /// bytesRead is the number of payload bytes received (status bytes are not included).
+        uint64_t bytesRead;
+
+        /// bytesWritten is the number of bytes acknowledged by the chip.
+        uint64_t bytesWritten;
+
+        /// readTransfers is the number of bulk transfers from the chip.
+        uint64_t readTransfers;
+
+        /// writeTransfers is the number of bulk transfers to the chip.
+        uint64_t writeTransfers;
+
+        /// statusOnlyReads is the number of read transfers which contained only status bytes.
+        uint64_t statusOnlyReads;
+
+        /// shortPackets is the number of read transfers terminated by an incomplete packet.
+        uint64_t shortPackets;
+
+        /// timeouts is the number of transfers (in both directions) which reached the timeout.
+        uint64_t timeouts;
+
+        /// partialWrites is the number of write transfers which sent less bytes than requested.
+        uint64_t partialWrites;
+
+        /// overruns is the number of read transfers which reported a receive buffer overrun.
+        uint64_t overruns;
+
+        /// lineErrors is the number of read transfers which reported a parity error, a framing error or a break interrupt.
+        uint64_t lineErrors;
+
+        /// bufferedBytes is the number of bytes waiting in the write buffer.
+        uint64_t bufferedBytes;
+
+        /// pendingBytes is the number of bytes passed to the write calls which have not returned yet.
+        uint64_t pendingBytes;
+
+        /// readLatencies is a histogram of the read transfers durations (see bucket).
+        std::array<uint64_t, 128> readLatencies;
+
+        /// writeLatencies is a histogram of the write transfers durations (see bucket).
+        std::array<uint64_t, 128> writeLatencies;
+
+        /// bucket returns the histogram bucket of a duration in microseconds.
+        /// Durations below 4 us have one bucket per microsecond, longer durations have four linear buckets per power of two.
+        static std::size_t bucket(uint64_t microseconds) {
+            if (microseconds < 4) {
+                return static_cast<std::size_t>(microseconds);
+            }
+            const auto exponent = static_cast<std::size_t>(63 - __builtin_clzll(microseconds));
+            return std::min(
+                static_cast<std::size_t>(4 * (exponent - 1) + ((microseconds >> (exponent - 2)) & 3)),
+                static_cast<std::size_t>(127)
+            );
+        }
+
+        /// lowerBound returns the smallest duration in microseconds which belongs to the given bucket.
+        static uint64_t lowerBound(std::size_t bucket) {
+            if (bucket < 4) {
+                return bucket;
+            }
+            return static_cast<uint64_t>(4 + bucket % 4) << (bucket / 4 - 1);
+        }
+    };
+
+    /// WriteResult reports the outcome of a write.
+    struct WriteResult {
+        /// accepted is the number of bytes sent to the chip or stored in the write buffer, counted from the beginning of the written vector.
+        std::size_t accepted;
+
+        /// error is the libusb error code of the failed transfer, or LIBUSB_SUCCESS.
+        /// A transfer which ends early without an error code is reported as LIBUSB_ERROR_IO.
+        int32_t error;
+
+        /// complete returns true if no transfer failed.
+        bool complete() const {
+            return error == LIBUSB_SUCCESS;
+        }
+    };
+
+    /// ReadStatus holds the status bytes which prefix the packets of a read transfer, and the transfer's completion time.
+    /// The status bytes of the packets in a transfer are combined with a bitwise or.
+    struct ReadStatus {
+        /// modemStatus is the first status byte (bit 4: clear to send, bit 5: data set ready, bit 6: ring indicator, bit 7: receive line signal detect).
+        uint8_t modemStatus;
+
+        /// lineStatus is the second status byte (bit 1: overrun, bit 2: parity error, bit 3: framing error, bit 4: break interrupt, bit 7: receive FIFO error).
+        uint8_t lineStatus;
+
+        /// sequence is the transfer's index among the chip's read transfers, in completion order.
+        uint64_t sequence;
+
+        /// monotonicTimestamp is the CLOCK_MONOTONIC time in nanoseconds at which the transfer completed.
+        int64_t monotonicTimestamp;
+
+        /// realtimeTimestamp is the CLOCK_REALTIME time in nanoseconds at which the transfer completed.
+        int64_t realtimeTimestamp;
+
+        /// stamp sets the sequence number and the completion timestamps (two vDSO calls under Linux, without system calls).
+        void stamp(uint64_t transferSequence) {
+            sequence = transferSequence;
+            monotonicTimestamp = clockTime(CLOCK_MONOTONIC);
+            realtimeTimestamp = clockTime(CLOCK_REALTIME);
+        }
+
+        /// clockTime returns the given clock's time in nanoseconds.
+        static int64_t clockTime(clockid_t clock) {
+            auto time = timespec{};
+            clock_gettime(clock, &time);
+            return static_cast<int64_t>(time.tv_sec) * 1000000000 + static_cast<int64_t>(time.tv_nsec);
+        }
+
+        /// overrun returns true if the chip's receive buffer lost data because the computer did not read fast enough.
+        bool overrun() const {
+            return (lineStatus & 0x02) != 0;
+        }
+
+        /// parityError returns true if the chip detected a parity error.
+        bool parityError() const {
+            return (lineStatus & 0x04) != 0;
+        }
+
+        /// framingError returns true if the chip detected a framing error.
+        bool framingError() const {
+            return (lineStatus & 0x08) != 0;
+        }
+
+        /// breakInterrupt returns true if the chip detected a break interrupt.
+        bool breakInterrupt() const {
+            return (lineStatus & 0x10) != 0;
+        }
+    };
+
+    /// DeviceBuffer is a fixed-capacity byte buffer used for USB transfers.
+    /// The memory is allocated by the kernel driver if libusb supports it (Linux), so that transfers do not copy the bytes.
+    /// Otherwise, or if the device is null, regular memory is used.
+    class DeviceBuffer {
         public:
-            Chip(uint32_t timeout = 5000, uint16_t vendorId = 1027, uint16_t productId = 24596) :
-                _timeout(timeout),
-                _usbContext(nullptr),
-                _usbHandle(nullptr)
+            DeviceBuffer() :
+                _usbHandle(nullptr),
+                _data(nullptr),
+                _size(0),
+                _capacity(0),
+                _deviceMemory(false)
             {
-                checkUsbError(libusb_init(&_usbContext), "initialize libusb");
-
-                libusb_device** usbDevices;
-                const auto numberOfDevices = libusb_get_device_list(_usbContext, &usbDevices);
-                if (numberOfDevices < 0) {
-                    libusb_exit(_usbContext);
-                    throw std::runtime_error("getting the devices list failed");
-                }
-                for (std::size_t index = 0; index < static_cast<std::size_t>(numberOfDevices); ++index) {
-                    libusb_device_descriptor descriptor;
-                    const auto error = libusb_get_device_descriptor(usbDevices[index], &descriptor);
-                    if (error != 0) {
-                        libusb_exit(_usbContext);
-                        throw std::runtime_error("retrieving the device descriptor failed with the error " + std::to_string(error));
+            }
+            DeviceBuffer(libusb_device_handle* usbHandle, std::size_t capacity) :
+                _usbHandle(usbHandle),
+                _data(nullptr),
+                _size(0),
+                _capacity(capacity),
+                _deviceMemory(false)
+            {
+                #if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+                    if (_usbHandle != nullptr) {
+                        _data = libusb_dev_mem_alloc(_usbHandle, _capacity);
+                        _deviceMemory = _data != nullptr;
                     }
-                    if (descriptor.idVendor == vendorId && descriptor.idProduct == productId) {
-                        const auto error = libusb_open(usbDevices[index], &_usbHandle);
-                        if (error != 0) {
-                            libusb_exit(_usbContext);
-                            throw std::runtime_error("opening the device failed with the error " + std::to_string(error));
-                        }
-                        break;
+                #endif
+                if (_data == nullptr) {
+                    _data = static_cast<uint8_t*>(std::malloc(_capacity));
+                    if (_data == nullptr) {
+                        throw std::runtime_error("allocating a buffer failed");
                     }
                 }
-                if (_usbHandle == nullptr) {
-                    libusb_exit(_usbContext);
-                    throw std::runtime_error("no device with the correct vendor and product ids could be find");
+            }
+            DeviceBuffer(const DeviceBuffer&) = delete;
+            DeviceBuffer(DeviceBuffer&& other) :
+                DeviceBuffer()
+            {
+                swap(other);
+            }
+            DeviceBuffer& operator=(const DeviceBuffer&) = delete;
+            DeviceBuffer& operator=(DeviceBuffer&& other) {
+                DeviceBuffer released(std::move(other));
+                swap(released);
+                return *this;
+            }
+            virtual ~DeviceBuffer() {
+                if (_data != nullptr) {
+                    #if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+                        if (_deviceMemory) {
+                            libusb_dev_mem_free(_usbHandle, _data, _capacity);
+                            return;
+                        }
+                    #endif
+                    std::free(_data);
                 }
-                libusb_free_device_list(usbDevices, 1);
-                configure();
             }
-            Chip(std::string id, uint32_t timeout = 5000, uint16_t vendorId = 1027, uint16_t productId = 24596) :
+
+            /// data returns a pointer to the buffer's first byte.
+            uint8_t* data() {
+                return _data;
+            }
+
+            /// size returns the number of bytes stored in the buffer.
+            std::size_t size() const {
+                return _size;
+            }
+
+            /// capacity returns the maximum number of bytes that the buffer can hold.
+            std::size_t capacity() const {
+                return _capacity;
+            }
+
+            /// empty returns true if the buffer holds no bytes.
+            bool empty() const {
+                return _size == 0;
+            }
+
+            /// deviceMemory returns true if the memory was allocated by the kernel driver.
+            bool deviceMemory() const {
+                return _deviceMemory;
+            }
+
+            /// append copies bytes at the end of the buffer, which must have enough space left.
+            void append(const uint8_t* bytes, std::size_t size) {
+                if (size > 0) {
+                    std::memcpy(_data + _size, bytes, size);
+                    _size += size;
+                }
+            }
+
+            /// consume removes bytes from the beginning of the buffer.
+            void consume(std::size_t size) {
+                std::memmove(_data, _data + size, _size - size);
+                _size -= size;
+            }
+
+            /// prefault writes to every page of the buffer, so that transfers do not trigger page faults.
+            void prefault() {
+                const auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+                for (std::size_t index = 0; index < _capacity; index += pageSize) {
+                    _data[index] = 0;
+                }
+            }
+
+            /// swap exchanges the contents of two buffers.
+            void swap(DeviceBuffer& other) {
+                std::swap(_usbHandle, other._usbHandle);
+                std::swap(_data, other._data);
+                std::swap(_size, other._size);
+                std::swap(_capacity, other._capacity);
+                std::swap(_deviceMemory, other._deviceMemory);
+            }
+
+        protected:
+            libusb_device_handle* _usbHandle;
+            uint8_t* _data;
+            std::size_t _size;
+            std::size_t _capacity;
+            bool _deviceMemory;
+    };
+
+    /// HighSpeed configures a FT232H chip connected to a high-speed USB port.
+    struct HighSpeed {
+        /// packetSize returns the size of the USB packets sent by the chip, status bytes included.
+        static constexpr std::size_t packetSize() {
+            return 512;
+        }
+
+        /// statusSize returns the number of status bytes which start every packet sent by the chip.
+        static constexpr std::size_t statusSize() {
+            return 2;
+        }
+
+        /// transferSize returns the size of the bulk transfers used when reading and writting data.
+        static constexpr std::size_t transferSize() {
+            return 65536;
+        }
+
+        /// inEndpoint returns the address of the endpoint used to read data.
+        static constexpr uint8_t inEndpoint() {
+            return 129;
+        }
+
+        /// outEndpoint returns the address of the endpoint used to write data.
+        static constexpr uint8_t outEndpoint() {
+            return 2;
+        }
+    };
+
+    /// FullSpeed configures a FT232H chip connected to a full-speed USB port.
+    struct FullSpeed : public HighSpeed {
+        /// packetSize returns the size of the USB packets sent by the chip, status bytes included.
+        static constexpr std::size_t packetSize() {
+            return 64;
+        }
+
+        /// transferSize returns the size of the bulk transfers used when reading and writting data.
+        static constexpr std::size_t transferSize() {
+            return 4096;
+        }
+    };
+
+    /// BasicChip represents a FT232H chip, with packet and transfer sizes and endpoints given by the Configuration type.
+    /// One thread can read while other threads write: the read and write functions use independent endpoints and buffers.
+    /// write can be called by several threads at once: concurrent calls are combined into shared transfers, and their bytes are sent
+    /// in call order, each call's bytes being contiguous. The other functions must be called by one thread at a time.
+    template <typename Configuration>
+    class BasicChip {
+        public:
+            /// ChipConfiguration is the Configuration type, which cannot be named outside the class since it is a template parameter.
+            using ChipConfiguration = Configuration;
+
+            BasicChip(uint32_t timeout = 5000, uint16_t vendorId = 1027, uint16_t productId = 24596, bool purge = true) :
                 _timeout(timeout),
+                _vendorId(vendorId),
+                _productId(productId),
                 _usbContext(nullptr),
-                _usbHandle(nullptr)
+                _usbHandle(nullptr),
+                _speed(LIBUSB_SPEED_UNKNOWN),
+                _packetSize(Configuration::packetSize()),
+                _transferSize(Configuration::transferSize()),
+                _counters(new Counters()),
+                _writeQueue(new WriteQueue()),
+                _transfers(new TransferList())
+            {
+                checkUsbError(libusb_init(&_usbContext), "initialize libusb");
+                connect(purge);
+            }
+            BasicChip(std::string id, uint32_t timeout = 5000, uint16_t vendorId = 1027, uint16_t productId = 24596, bool purge = true) :
+                _timeout(timeout),
+                _vendorId(vendorId),
+                _productId(productId),
+                _id(id),
+                _usbContext(nullptr),
+                _usbHandle(nullptr),
+                _speed(LIBUSB_SPEED_UNKNOWN),
+                _packetSize(Configuration::packetSize()),
+                _transferSize(Configuration::transferSize()),
+                _counters(new Counters()),
+                _writeQueue(new WriteQueue()),
+                _transfers(new TransferList())
             {
                 if (id.size() > 32) {
                     throw std::runtime_error("the id cannot have more than 32 characters");
                 }
                 checkUsbError(libusb_init(&_usbContext), "initialize libusb");
-                libusb_device** usbDevices;
-                const auto numberOfDevices = libusb_get_device_list(_usbContext, &usbDevices);
-                if (numberOfDevices < 0) {
-                    libusb_exit(_usbContext);
-                    throw std::runtime_error("getting the devices list failed");
+                connect(purge);
+            }
+            BasicChip(const BasicChip&) = delete;
+            BasicChip(BasicChip&& other) :
+                _timeout(0),
+                _vendorId(0),
+                _productId(0),
+                _usbContext(nullptr),
+                _usbHandle(nullptr),
+                _speed(LIBUSB_SPEED_UNKNOWN),
+                _packetSize(0),
+                _transferSize(0)
+            {
+                swap(other);
+            }
+            BasicChip& operator=(const BasicChip&) = delete;
+
+            /// operator= takes the other chip's device, whose destructor releases the chip's previous device.
+            BasicChip& operator=(BasicChip&& other) {
+                swap(other);
+                return *this;
+            }
+            virtual ~BasicChip() {
+
+                // the notifiers are not called while the device is closed
+                if (_pollfdNotifiers && _usbContext != nullptr) {
+                    libusb_set_pollfd_notifiers(_usbContext, nullptr, nullptr, nullptr);
                 }
-                for (std::size_t index = 0; index < numberOfDevices; ++index) {
-                    libusb_device_descriptor descriptor;
-                    const auto error = libusb_get_device_descriptor(usbDevices[index], &descriptor);
-                    if (error != 0) {
-                        libusb_exit(_usbContext);
-                        throw std::runtime_error("retrieving the device descriptor failed with the error " + std::to_string(error));
+                if (_transfers) {
+
+                    // the transfers in flight are cancelled and reaped before the device is closed
+                    // their handlers may reference destroyed objects, hence they are not called
+                    _transfers->closing = true;
+                    for (auto transfer : _transfers->inFlight) {
+                        libusb_cancel_transfer(transfer->usbTransfer);
                     }
-                    if (descriptor.idVendor == vendorId && descriptor.idProduct == productId) {
-                        const auto error = libusb_open(usbDevices[index], &_usbHandle);
-                        if (error != 0) {
-                            libusb_exit(_usbContext);
-                            throw std::runtime_error("opening the device failed with the error " + std::to_string(error));
-                        }
-                        auto retrievedId = std::string();
-                        for (auto registerIndex = static_cast<uint16_t>(86); registerIndex < 128; ++registerIndex) {
-                            auto buffer = std::array<uint8_t, 2>{};
-                            checkUsbTransferError(libusb_control_transfer(
-                                _usbHandle,
-                                inputRequestType(),
-                                0x90,
-                                0,
-                                registerIndex,
-                                buffer.data(),
-                                buffer.size(),
-                                5000
-                            ), buffer.size(), "reading the eeprom");
-                            if (std::get<0>(buffer) == 0x10 && std::get<1>(buffer) == 0x03) {
-                                break;
-                            }
-                            retrievedId.push_back(std::get<0>(buffer));
-                        }
-                        if (retrievedId == id) {
+                    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout);
+                    while (!_transfers->inFlight.empty() && std::chrono::steady_clock::now() < deadline) {
+                        try {
+                            BasicChip::handleEvents(10);
+                        } catch (...) {
                             break;
                         }
-                        libusb_close(_usbHandle);
-                        _usbHandle = nullptr;
-                        continue;
                     }
+                    for (auto transfer : _transfers->parked) {
+                        libusb_free_transfer(transfer->usbTransfer);
+                        delete transfer;
+                    }
+                    for (auto transfer : _transfers->transferPool) {
+                        libusb_free_transfer(transfer->usbTransfer);
+                        delete transfer;
+                    }
+                    _transfers->packetsPool.clear();
                 }
-                if (_usbHandle == nullptr) {
+                _readBuffer = DeviceBuffer();
+                _writeBuffer = DeviceBuffer();
+                if (_usbHandle != nullptr) {
+                    libusb_close(_usbHandle);
+                }
+                if (_usbContext != nullptr) {
                     libusb_exit(_usbContext);
-                    throw std::runtime_error("the requested device could not be found");
                 }
-                libusb_free_device_list(usbDevices, 1);
-                configure();
-            }
-            Chip(const Chip&) = delete;
-            Chip(Chip&&) = default;
-            Chip& operator=(const Chip&) = delete;
-            Chip& operator=(Chip&&) = default;
-            virtual ~Chip() {
-                libusb_close(_usbHandle);
-                libusb_exit(_usbContext);
             }
 
             /// write sends bytes to the chip.
+            /// This function can be called from several threads at once. The calling thread either waits for its bytes to be sent
+            /// by another writing thread, or sends the bytes of all the waiting threads with as few transfers as possible (flat combining).
+            /// A waiting thread spins briefly, then sleeps until the combining thread has sent its bytes.
             virtual void write(const std::vector<uint8_t>& bytes, bool flush = true) {
-                int32_t bytesSent;
-                auto begin = bytes.begin();
+                checkUsbError(tryWrite(bytes, flush).error, "writing bytes");
+            }
 
-                // complete the buffer
-                if (!_writeBuffer.empty()) {
-                    const auto spaceLeft = chunkSize() - _writeBuffer.size();
-                    if (bytes.size() < spaceLeft) {
-                        _writeBuffer.insert(_writeBuffer.end(), bytes.begin(), bytes.end());
-                        if (flush) {
-                            checkUsbError(libusb_bulk_transfer(
-                                _usbHandle,
-                                2,
-                                const_cast<uint8_t*>(_writeBuffer.data()),
-                                static_cast<int32_t>(_writeBuffer.size()),
-                                &bytesSent,
-                                _timeout
-                            ), "writing bytes");
-                            checkSize(_writeBuffer.size(), bytesSent, "writing bytes");
-                            _writeBuffer.clear();
+            /// tryWrite sends bytes to the chip, starting at the given offset, and reports the failed transfers instead of throwing.
+            /// Bytes which were not sent because of a failed transfer are either reported as not accepted, or kept in the write buffer
+            /// and sent by the next write. Calling tryWrite again with the accepted count as offset resumes the write.
+            virtual WriteResult tryWrite(const std::vector<uint8_t>& bytes, bool flush = true, std::size_t offset = 0) {
+                if (offset > bytes.size()) {
+                    throw std::runtime_error("the offset must not exceed the number of bytes");
+                }
+                WriteRequest request(bytes, flush, offset);
+                auto head = _writeQueue->head.load(std::memory_order_relaxed);
+                do {
+                    request.next = head;
+                } while (!_writeQueue->head.compare_exchange_weak(head, &request, std::memory_order_seq_cst, std::memory_order_relaxed));
+                _counters->pendingBytes.fetch_add(bytes.size() - offset, std::memory_order_relaxed);
+                auto spins = static_cast<std::size_t>(0);
+                while (!request.done.load(std::memory_order_acquire)) {
+                    if (_writeQueue->combining.exchange(true, std::memory_order_seq_cst)) {
+                        if (spins < 64) {
+                            ++spins;
+                            std::this_thread::yield();
+                            continue;
                         }
-                        return;
-                    } else {
-                        begin = std::next(bytes.begin(), spaceLeft);
-                        _writeBuffer.insert(_writeBuffer.end(), bytes.begin(), begin);
-                        checkUsbError(libusb_bulk_transfer(
-                            _usbHandle,
-                            2,
-                            const_cast<uint8_t*>(_writeBuffer.data()),
-                            static_cast<int32_t>(_writeBuffer.size()),
-                            &bytesSent,
-                            _timeout
-                        ), "writing bytes");
-                        checkSize(_writeBuffer.size(), bytesSent, "writing bytes");
-                        _writeBuffer.clear();
+
+                        // the combining thread may wait for a transfer until the timeout, hence the request sleeps until it is done
+                        // the combining thread checks the queue after releasing the flag, so the request is always processed
+                        std::unique_lock<std::mutex> lock(request.mutex);
+                        request.condition.wait(lock, [&]() {
+                            return request.done.load(std::memory_order_acquire);
+                        });
+                        break;
                     }
-                }
+                    for (;;) {
+                        for (;;) {
+                            auto requests = _writeQueue->head.exchange(nullptr, std::memory_order_acquire);
+                            if (requests == nullptr) {
+                                break;
+                            }
+                            combine(requests);
+                        }
+                        _writeQueue->combining.store(false, std::memory_order_seq_cst);
 
-                // send complete chunks
-                for (std::size_t chunkIndex = 0; chunkIndex < std::distance(begin, bytes.end()) / chunkSize(); ++chunkIndex) {
-                    checkUsbError(libusb_bulk_transfer(
-                        _usbHandle,
-                        2,
-                        const_cast<uint8_t*>(&*begin),
-                        static_cast<int32_t>(chunkSize()),
-                        &bytesSent,
-                        _timeout
-                    ), "writing bytes");
-                    checkSize(chunkSize(), bytesSent, "writing bytes");
-                    std::advance(begin, chunkSize());
+                        // a request pushed while the flag was released is processed now, unless another thread took the flag
+                        if (
+                            _writeQueue->head.load(std::memory_order_seq_cst) == nullptr
+                            || _writeQueue->combining.exchange(true, std::memory_order_seq_cst)
+                        ) {
+                            break;
+                        }
+                    }
                 }
 
-                // flush the extra bytes or fill the buffer
-                if (begin != bytes.end()) {
-                    if (flush) {
-                        const auto left = std::distance(begin, bytes.end());
-                        checkUsbError(libusb_bulk_transfer(
-                            _usbHandle,
-                            2,
-                            const_cast<uint8_t*>(&*begin),
-                            static_cast<int32_t>(left),
-                            &bytesSent,
-                            _timeout
-                        ), "writing bytes");
-                        checkSize(left, bytesSent, "writing bytes");
-                    } else {
-                        _writeBuffer.insert(_writeBuffer.begin(), begin, bytes.end());
-                    }
+                // the combining thread marks the request as done while holding its mutex, and notifies the condition before releasing it
+                // locking the mutex waits for the release, so that the request is not destroyed while the condition is notified
+                {
+                    std::lock_guard<std::mutex> lock(request.mutex);
                 }
+                _counters->pendingBytes.fetch_sub(bytes.size() - offset, std::memory_order_relaxed);
+                if (request.exception) {
+                    std::rethrow_exception(request.exception);
+                }
+                return request.result;
             }
 
             /// read receives bytes from the chip.
             virtual std::vector<uint8_t> read() {
-                auto bytes = std::vector<uint8_t>(chunkSize());
+                auto status = ReadStatus{};
+                return read(status);
+            }
+
+            /// read receives bytes from the chip and retrieves the transfer's status bytes.
+            virtual std::vector<uint8_t> read(ReadStatus& status) {
+                auto bytes = std::vector<uint8_t>();
                 auto actualSize = 0;
-                checkUsbError(libusb_bulk_transfer(_usbHandle, 129, bytes.data(), static_cast<int32_t>(bytes.size()), &actualSize, 5000), "reading bytes");
-                if (actualSize > 2) {
-                    const auto fullPackets = actualSize / 512;
-                    for (std::size_t packetIndex = 0; packetIndex < fullPackets; ++packetIndex) {
-                        std::copy(
-                            std::next(bytes.begin(), 512 * packetIndex + 2),
-                            std::next(bytes.begin(), 512 * (packetIndex + 1)),
-                            std::next(bytes.begin(), 510 * packetIndex)
-                        );
-                    }
-                    const auto lastPacketSize = actualSize % 512;
-                    if (lastPacketSize > 2) {
-                        std::copy(
-                            std::prev(bytes.end(), lastPacketSize - 2),
-                            bytes.end(),
-                            std::next(bytes.begin(), 510 * fullPackets)
-                        );
-                        bytes.resize(510 * fullPackets + lastPacketSize - 2);
-                    } else {
-                        bytes.resize(510 * fullPackets);
-                    }
-                } else {
-                    bytes.clear();
+                const auto begin = std::chrono::steady_clock::now();
+                const auto error = libusb_bulk_transfer(
+                    _usbHandle,
+                    Configuration::inEndpoint(),
+                    _readBuffer.data(),
+                    static_cast<int32_t>(_readBuffer.capacity()),
+                    &actualSize,
+                    _timeout
+                );
+                status.stamp(_counters->readTransfers.fetch_add(1, std::memory_order_relaxed));
+                _counters->record(_counters->readLatencies, begin);
+                if (error == LIBUSB_ERROR_TIMEOUT) {
+                    _counters->timeouts.fetch_add(1, std::memory_order_relaxed);
                 }
+                checkUsbError(error, "reading bytes");
+                parsePackets(_readBuffer.data(), static_cast<std::size_t>(actualSize), bytes, status);
+                _counters->bytesRead.fetch_add(bytes.size(), std::memory_order_relaxed);
                 return bytes;
             }
 
-        protected:
+            /// setOverrunHandler registers a function called by read when the chip reports a receive buffer overrun.
+            /// The handler is called from the reading thread, before read returns.
+            virtual void setOverrunHandler(std::function<void(ReadStatus)> overrunHandler) {
+                _overrunHandler = std::move(overrunHandler);
+            }
 
-            /// checkUsbError throws an exception if the returned code is not zero.
-            static void checkUsbError(int32_t error, std::string message) {
+            /// setLatencyTimer changes the delay in milliseconds after which the chip sends an incomplete packet.
+            /// The latency timer is set to 16 ms by default.
+            virtual void setLatencyTimer(uint8_t latencyTimer) {
+                if (latencyTimer == 0) {
+                    throw std::runtime_error("the latency timer must be at least 1 ms");
+                }
+                checkUsbTransferError(
+                    libusb_control_transfer(_usbHandle, outputRequestType(), 9, latencyTimer, 1, nullptr, 0, _timeout),
+                    0,
+                    "setting the latency timer"
+                );
+            }
+
+            /// purgeRx discards the bytes held by the chip and not yet read.
+            virtual void purgeRx() {
+                checkUsbTransferError(
+                    libusb_control_transfer(_usbHandle, outputRequestType(), 0, 2, 1, nullptr, 0, _timeout),
+                    0,
+                    "purging the receive buffer"
+                );
+            }
+
+            /// purgeTx discards the bytes received by the chip and not yet sent to the FIFO.
+            /// The bytes stored in the write buffer are not affected.
+            virtual void purgeTx() {
+                checkUsbTransferError(
+                    libusb_control_transfer(_usbHandle, outputRequestType(), 0, 1, 1, nullptr, 0, _timeout),
+                    0,
+                    "purging the transmit buffer"
+                );
+            }
+
+            /// submitWrite starts an asynchronous transfer of bytes to the chip, and returns immediately.
+            /// The bytes must remain valid until the handler is called.
+            /// The handler is called by handleEvents, with the transfer status and the number of bytes sent.
+            /// Asynchronous transfers are sent in submission order, but may overtake bytes written with write.
+            virtual void submitWrite(
+                const uint8_t* bytes,
+                std::size_t size,
+                std::function<void(libusb_transfer_status, std::size_t)> handler
+            ) {
+                auto transfer = _transfers->takeTransfer();
+                transfer->handler = std::move(handler);
+                transfer->counters = _counters.get();
+                transfer->transfers = _transfers.get();
+                transfer->begin = std::chrono::steady_clock::now();
+                transfer->sent = 0;
+                transfer->chip = this;
+                libusb_fill_bulk_transfer(
+                    transfer->usbTransfer,
+                    _usbHandle,
+                    Configuration::outEndpoint(),
+                    const_cast<uint8_t*>(bytes),
+                    static_cast<int32_t>(size),
+                    &BasicChip::onWriteCompleted,
+                    transfer,
+                    _timeout
+                );
+                const auto error = libusb_submit_transfer(transfer->usbTransfer);
                 if (error != 0) {
-                    throw std::runtime_error(message + " failed with the error " + libusb_error_name(error));
+                    _transfers->release(transfer);
+                    checkUsbError(error, "submitting a transfer");
                 }
+                _transfers->inFlight.push_back(transfer);
             }
 
-            /// checkUsbTransferError throws an exception if the returned code is negative or if the unexpected number of bytes is transferred.
-            static void checkUsbTransferError(int32_t error, std::size_t expectedLength, std::string message) {
-                if (error < 0) {
-                    throw std::runtime_error(message + " failed with the error " + libusb_error_name(error));
+            /// submitRead starts an asynchronous read transfer, and returns immediately.
+            /// The handler is called by handleEvents, with the transfer status, the received bytes and the transfer's status bytes.
+            /// The bytes are only valid until the handler returns. The handler may call submitRead to keep reads in flight.
+            /// The transfers and their buffers are pooled, and the buffers are pre-faulted, so that resubmitted reads do not allocate memory
+            /// (provided that the handler's captures fit in std::function's small buffer, for instance a pointer).
+            virtual void submitRead(std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, ReadStatus)> handler) {
+                submitRead(std::move(handler), chunkSize());
+            }
+
+            /// submitRead starts an asynchronous read transfer of at most size bytes (status bytes included).
+            /// The size is rounded up to a multiple of the packet size, and clamped to the transfer size.
+            /// Small transfers reduce the time spent by the host on each completion, at the cost of more transfers.
+            virtual void submitRead(std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, ReadStatus)> handler, std::size_t size) {
+                auto transfer = _transfers->takeTransfer();
+                transfer->counters = _counters.get();
+                transfer->transfers = _transfers.get();
+                transfer->begin = std::chrono::steady_clock::now();
+                transfer->sent = 0;
+                transfer->readHandler = std::move(handler);
+                transfer->chip = this;
+                transfer->packets = _transfers->takePackets(_usbHandle, chunkSize());
+                transfer->readStatus = ReadStatus{};
+                const auto packets = std::max((size + _packetSize - 1) / _packetSize, static_cast<std::size_t>(1));
+                const auto length = std::min(packets * _packetSize, chunkSize());
+                libusb_fill_bulk_transfer(
+                    transfer->usbTransfer,
+                    _usbHandle,
+                    Configuration::inEndpoint(),
+                    transfer->packets.data(),
+                    static_cast<int32_t>(length),
+                    &BasicChip::onReadCompleted,
+                    transfer,
+                    _timeout
+                );
+                const auto error = libusb_submit_transfer(transfer->usbTransfer);
+                if (error != 0) {
+                    _transfers->packetsPool.push_back(std::move(transfer->packets));
+                    _transfers->release(transfer);
+                    checkUsbError(error, "submitting a transfer");
                 }
-                if (error != expectedLength) {
-                    throw std::runtime_error(
-                        message
-                        + " failed (expected a transfer of "
-                        + std::to_string(expectedLength)
-                        + " bytes, transferred "
-                        + std::to_string(error)
-                        + ")"
-                    );
+                _transfers->inFlight.push_back(transfer);
+            }
+
+            /// handleEvents waits at most timeout milliseconds for asynchronous transfers to complete, and calls their handlers.
+            virtual void handleEvents(uint32_t timeout) {
+                auto duration = timeval{static_cast<time_t>(timeout / 1000), static_cast<suseconds_t>((timeout % 1000) * 1000)};
+                const auto error = libusb_handle_events_timeout_completed(_usbContext, &duration, nullptr);
+                if (error != LIBUSB_ERROR_INTERRUPTED) {
+                    checkUsbError(error, "handling events");
                 }
             }
 
-            /// checkSize throws an error if the expected number of bytes is not equal to the actual number of bytes.
-            static void checkSize(std::size_t expected, int32_t actual, std::string message) {
-                if (expected != actual) {
-                    throw std::runtime_error(message + " failed (expected " + std::to_string(expected) + " bytes, got " + std::to_string(actual) + " bytes");
+            /// pollfds returns the file descriptors to watch, with the events to watch for (POLLIN, POLLOUT),
+            /// so that the asynchronous transfers can be driven by an external event loop (poll, epoll...).
+            /// processEvents must be called when one of the file descriptors is ready, or when the delay returned by nextTimeout expires.
+            /// The file descriptors change when the device is reopened by recover (see setPollfdNotifiers).
+            virtual std::vector<libusb_pollfd> pollfds() const {
+                const auto usbPollfds = libusb_get_pollfds(_usbContext);
+                if (usbPollfds == nullptr) {
+                    throw std::runtime_error("retrieving the file descriptors failed (unsupported on this platform)");
                 }
+                auto result = std::vector<libusb_pollfd>();
+                for (auto usbPollfd = usbPollfds; *usbPollfd != nullptr; ++usbPollfd) {
+                    result.push_back(**usbPollfd);
+                }
+                #if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000104
+                    libusb_free_pollfds(usbPollfds);
+                #else
+                    std::free(usbPollfds);
+                #endif
+                return result;
             }
 
-            /// chunkSize returns the chunk size used when reading and writting data.
-            static std::size_t chunkSize() {
-                return 65536;
+            /// setPollfdNotifiers registers functions called when a file descriptor is added to or removed from the ones returned by pollfds,
+            /// for instance when recover reopens the device, so that an external event loop can update the descriptors it watches.
+            /// The functions are called by the thread which changes the file descriptors. Empty functions unregister the notifiers.
+            /// setPollfdNotifiers must not be called while other threads use the chip.
+            virtual void setPollfdNotifiers(std::function<void(libusb_pollfd)> added, std::function<void(int32_t)> removed) {
+                if (!_pollfdNotifiers) {
+                    _pollfdNotifiers.reset(new PollfdNotifiers());
+                }
+                libusb_set_pollfd_notifiers(_usbContext, nullptr, nullptr, nullptr);
+                _pollfdNotifiers->added = std::move(added);
+                _pollfdNotifiers->removed = std::move(removed);
+                if (_pollfdNotifiers->added || _pollfdNotifiers->removed) {
+                    libusb_set_pollfd_notifiers(_usbContext, onPollfdAdded, onPollfdRemoved, _pollfdNotifiers.get());
+                }
             }
 
-            /// inputRequestType returns the libusb type for input requests.
-            static uint8_t inputRequestType() {
-                return LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN;
+            /// nextTimeout returns the delay in milliseconds before processEvents must be called to expire a transfer,
+            /// or -1 if no transfer has a timeout.
+            virtual int32_t nextTimeout() const {
+                auto duration = timeval{0, 0};
+                const auto result = libusb_get_next_timeout(_usbContext, &duration);
+                if (result < 0) {
+                    checkUsbError(result, "retrieving the next timeout");
+                }
+                if (result == 0) {
+                    return -1;
+                }
+                return static_cast<int32_t>(duration.tv_sec * 1000 + (duration.tv_usec + 999) / 1000);
             }
 
-            /// outputRequestType returns the libusb type for output requests.
-            static uint8_t outputRequestType() {
-                return LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT;
+            /// processEvents handles the pending events without waiting, and calls the completed transfers' handlers.
+            virtual void processEvents() {
+                handleEvents(0);
             }
 
-            /// configure prepares the device for the FT245 style synchronous FIFO mode.
-            void configure() {
-                {
-                    libusb_detach_kernel_driver(_usbHandle, 0);
-                    const auto error = libusb_claim_interface(_usbHandle, 0);
-                    if (error == LIBUSB_ERROR_BUSY) {
-                        throw std::runtime_error("the requested device is busy");
-                    } else {
-                        checkUsbError(error, "claiming the interface");
+            /// recover restores the communication after a stall or a timeout, without reopening the device if possible.
+            /// The asynchronous transfers in flight are cancelled, the endpoints' halt conditions are cleared and the chip's receive buffer is purged
+            /// (the bytes received from the FIFO and not yet read are lost). The transmit buffer is not purged, since it may hold bytes
+            /// which the chip acknowledged before the cancellation and which are not resent.
+            /// If this fails, the device is reopened and configured, which resets the chip: the bytes acknowledged by the chip
+            /// but not yet delivered to the FIFO (at most the chip's transmit buffer) are then lost. If reopening fails, recover throws and leaves the chip unchanged, so that it can be called again.
+            /// The cancelled transfers are then resubmitted, without the bytes already sent.
+            /// Cancelled read transfers which received bytes complete with them instead.
+            /// The bytes stored in the write buffer are kept, and sent by the next write.
+            /// recover must not be called while other threads read or write, nor from a transfer handler.
+            virtual void recover() {
+                _transfers->recovering = true;
+                for (auto transfer : _transfers->inFlight) {
+                    libusb_cancel_transfer(transfer->usbTransfer);
+                }
+                const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout);
+                while (!_transfers->inFlight.empty() && std::chrono::steady_clock::now() < deadline) {
+                    handleEvents(10);
+                }
+                _transfers->recovering = false;
+                if (!_transfers->inFlight.empty()) {
+                    throw std::runtime_error("cancelling the transfers in flight timed out");
+                }
+                auto reopen = (
+                    libusb_clear_halt(_usbHandle, Configuration::inEndpoint()) != 0
+                    || libusb_clear_halt(_usbHandle, Configuration::outEndpoint()) != 0
+                );
+                if (!reopen) {
+                    try {
+                        purgeRx();
+                    } catch (const std::runtime_error&) {
+                        reopen = true;
                     }
                 }
-                try {
-                    checkUsbTransferError(
-                        libusb_control_transfer(_usbHandle, outputRequestType(), 0, 0, 1, nullptr, 0, _timeout),
-                        0,
-                        "resetting the device"
-                    );
-                    checkUsbTransferError(
-                        libusb_control_transfer(_usbHandle, outputRequestType(), 11, 16639, 1, nullptr, 0, _timeout),
-                        0,
-                        "setting the bitmode"
-                    );
-                    checkUsbTransferError(
-                        libusb_control_transfer(_usbHandle, outputRequestType(), 1, 257, 1, nullptr, 0, _timeout),
-                        0,
-                        "enabling the data-terminal-ready line"
-                    );
-                    checkUsbTransferError(
-                        libusb_control_transfer(_usbHandle, outputRequestType(), 1, 547, 1, nullptr, 0, _timeout),
-                        0,
-                        "clearing the request-to-send line"
-                    );
-                    checkUsbTransferError(
-                        libusb_control_transfer(_usbHandle, outputRequestType(), 2, 0, 257, nullptr, 0, _timeout),
-                        0,
-                        "enabling the flow control"
-                    );
-                    checkUsbTransferError(
-                        libusb_control_transfer(_usbHandle, outputRequestType(), 9, 16, 1, nullptr, 0, _timeout),
-                        0,
-                        "setting the latency timer"
-                    );
-                } catch (const std::runtime_error& exception) {
+                if (reopen) {
+
+                    // the new handle is opened and configured before the old one is closed, so that a failure leaves the chip unchanged
+                    // the old handle releases the interface so that the new one can claim it, and claims it again on failure
                     libusb_release_interface(_usbHandle, 0);
+                    libusb_device_handle* usbHandle = nullptr;
+                    auto link = Link{};
+                    auto readBuffer = DeviceBuffer();
+                    auto writeBuffer = DeviceBuffer();
+                    try {
+                        usbHandle = open();
+                        link = configure(usbHandle, true);
+                        readBuffer = DeviceBuffer(usbHandle, link.transferSize);
+                        readBuffer.prefault();
+                        writeBuffer = DeviceBuffer(usbHandle, link.transferSize);
+                        writeBuffer.prefault();
+                        if (_writeBuffer.size() > writeBuffer.capacity()) {
+                            throw std::runtime_error("the bytes stored in the write buffer do not fit in the reopened device's buffer");
+                        }
+                    } catch (...) {
+                        readBuffer = DeviceBuffer();
+                        writeBuffer = DeviceBuffer();
+                        if (usbHandle != nullptr) {
+                            libusb_close(usbHandle);
+                        }
+                        libusb_claim_interface(_usbHandle, 0);
+                        throw;
+                    }
+                    writeBuffer.append(_writeBuffer.data(), _writeBuffer.size());
+                    _transfers->packetsPool.clear();
+                    for (auto transfer : _transfers->parked) {
+                        if (transfer->readHandler && transfer->packets.deviceMemory()) {
+
+                            // the device memory is released with the handle
+                            auto packets = DeviceBuffer(nullptr, transfer->packets.capacity());
+                            std::copy(transfer->packets.data(), transfer->packets.data() + transfer->sent, packets.data());
+                            transfer->packets = std::move(packets);
+                        }
+                    }
+                    _readBuffer = std::move(readBuffer);
+                    _writeBuffer = std::move(writeBuffer);
                     libusb_close(_usbHandle);
-                    libusb_exit(_usbContext);
-                    throw exception;
+                    _usbHandle = usbHandle;
+                    _speed = link.speed;
+                    _packetSize = link.packetSize;
+                    _transferSize = link.transferSize;
                 }
-                _readBuffer.reserve(chunkSize());
-                _writeBuffer.reserve(chunkSize());
-            }
+                auto parked = std::vector<Transfer*>();
+                parked.swap(_transfers->parked);
+                for (auto transfer : parked) {
+                    auto usbTransfer = transfer->usbTransfer;
+                    usbTransfer->dev_handle = _usbHandle;
+                    if (transfer->readHandler) {
 
-            uint32_t _timeout;
-            libusb_context* _usbContext;
-            libusb_device_handle* _usbHandle;
-            std::vector<uint8_t> _readBuffer;
-            std::vector<uint8_t> _writeBuffer;
+                        // a read which received packets before its cancellation completes with them
+                        if (transfer->sent > 0) {
+                            complete(transfer, LIBUSB_TRANSFER_COMPLETED);
+                            continue;
+                        }
+                        usbTransfer->buffer = transfer->packets.data();
+                    } else {
+                        usbTransfer->buffer += usbTransfer->actual_length;
+                        usbTransfer->length -= usbTransfer->actual_length;
+                    }
+                    if (usbTransfer->length == 0) {
+                        complete(transfer, LIBUSB_TRANSFER_COMPLETED);
+                        continue;
+                    }
+                    transfer->begin = std::chrono::steady_clock::now();
+                    if (libusb_submit_transfer(usbTransfer) != 0) {
+                        complete(transfer, LIBUSB_TRANSFER_ERROR);
+                        continue;
+                    }
+                    _transfers->inFlight.push_back(transfer);
+                }
+            }
+
+            /// speed returns the speed negotiated by the chip's USB port.
+            virtual libusb_speed speed() const {
+                return _speed;
+            }
+
+            /// packetSize returns the maximum size of the packets sent by the chip, which depends on the speed.
+            virtual std::size_t packetSize() const {
+                return _packetSize;
+            }
+
+            /// transferSize returns the size of the read and write transfers, which depends on the speed.
+            virtual std::size_t transferSize() const {
+                return _transferSize;
+            }
+
+            /// statistics returns a snapshot of the chip's counters.
+            /// This function can be called from any thread.
+            virtual Statistics statistics() const {
+                return _counters->snapshot();
+            }
+
+            /// finished returns true if the chip will never receive bytes again (for instance, a consumed replay).
+            /// A device never finishes: an empty read only means that the chip had nothing to send.
+            virtual bool finished() const {
+                return false;
+            }
+
+        protected:
+
+            /// BasicChip takes ownership of an opened device, without configuring it.
+            /// Derived classes which do not communicate with a device use null pointers.
+            BasicChip(libusb_context* usbContext, libusb_device_handle* usbHandle, uint32_t timeout) :
+                _timeout(timeout),
+                _vendorId(0),
+                _productId(0),
+                _usbContext(usbContext),
+                _usbHandle(usbHandle),
+                _speed(LIBUSB_SPEED_UNKNOWN),
+                _packetSize(Configuration::packetSize()),
+                _transferSize(Configuration::transferSize()),
+                _readBuffer(usbHandle, Configuration::transferSize()),
+                _writeBuffer(usbHandle, Configuration::transferSize()),
+                _counters(new Counters()),
+                _writeQueue(new WriteQueue()),
+                _transfers(new TransferList())
+            {
+            }
+
+            /// Counters stores the chip's statistics.
+            struct Counters {
+                std::atomic<uint64_t> bytesRead{0};
+                std::atomic<uint64_t> bytesWritten{0};
+                std::atomic<uint64_t> readTransfers{0};
+                std::atomic<uint64_t> writeTransfers{0};
+                std::atomic<uint64_t> statusOnlyReads{0};
+                std::atomic<uint64_t> shortPackets{0};
+                std::atomic<uint64_t> timeouts{0};
+                std::atomic<uint64_t> partialWrites{0};
+                std::atomic<uint64_t> overruns{0};
+                std::atomic<uint64_t> lineErrors{0};
+                std::atomic<uint64_t> bufferedBytes{0};
+                std::atomic<uint64_t> pendingBytes{0};
+                std::array<std::atomic<uint64_t>, 128> readLatencies;
+                std::array<std::atomic<uint64_t>, 128> writeLatencies;
+
+                Counters() {
+                    for (std::size_t bucket = 0; bucket < readLatencies.size(); ++bucket) {
+                        readLatencies[bucket].store(0, std::memory_order_relaxed);
+                        writeLatencies[bucket].store(0, std::memory_order_relaxed);
+                    }
+                }
+
+                /// record adds the duration elapsed since begin to the given histogram.
+                static void record(std::array<std::atomic<uint64_t>, 128>& latencies, std::chrono::steady_clock::time_point begin) {
+                    latencies[Statistics::bucket(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - begin
+                    ).count()))].fetch_add(1, std::memory_order_relaxed);
+                }
+
+                /// countWrite updates the counters after a write transfer.
+                void countWrite(std::size_t size, std::size_t sent, bool timedOut, std::chrono::steady_clock::time_point begin) {
+                    record(writeLatencies, begin);
+                    writeTransfers.fetch_add(1, std::memory_order_relaxed);
+                    bytesWritten.fetch_add(sent, std::memory_order_relaxed);
+                    if (timedOut) {
+                        timeouts.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    if (sent != size) {
+                        partialWrites.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+
+                /// snapshot copies the counters.
+                Statistics snapshot() const {
+                    Statistics statistics;
+                    statistics.bytesRead = bytesRead.load(std::memory_order_relaxed);
+                    statistics.bytesWritten = bytesWritten.load(std::memory_order_relaxed);
+                    statistics.readTransfers = readTransfers.load(std::memory_order_relaxed);
+                    statistics.writeTransfers = writeTransfers.load(std::memory_order_relaxed);
+                    statistics.statusOnlyReads = statusOnlyReads.load(std::memory_order_relaxed);
+                    statistics.shortPackets = shortPackets.load(std::memory_order_relaxed);
+                    statistics.timeouts = timeouts.load(std::memory_order_relaxed);
+                    statistics.partialWrites = partialWrites.load(std::memory_order_relaxed);
+                    statistics.overruns = overruns.load(std::memory_order_relaxed);
+                    statistics.lineErrors = lineErrors.load(std::memory_order_relaxed);
+                    statistics.bufferedBytes = bufferedBytes.load(std::memory_order_relaxed);
+                    statistics.pendingBytes = pendingBytes.load(std::memory_order_relaxed);
+                    for (std::size_t bucket = 0; bucket < readLatencies.size(); ++bucket) {
+                        statistics.readLatencies[bucket] = readLatencies[bucket].load(std::memory_order_relaxed);
+                        statistics.writeLatencies[bucket] = writeLatencies[bucket].load(std::memory_order_relaxed);
+                    }
+                    return statistics;
+                }
+            };
+
+            /// WriteRequest is a write call waiting to be combined.
+            /// The mutex and the condition let the calling thread sleep until the request is done.
+            struct WriteRequest {
+                const std::vector<uint8_t>& bytes;
+                const bool flush;
+                const std::size_t offset;
+                WriteRequest* next;
+                std::atomic<bool> done;
+                WriteResult result;
+                std::exception_ptr exception;
+                std::mutex mutex;
+                std::condition_variable condition;
+
+                WriteRequest(const std::vector<uint8_t>& bytes, bool flush, std::size_t offset) :
+                    bytes(bytes),
+                    flush(flush),
+                    offset(offset),
+                    next(nullptr),
+                    done(false),
+                    result(WriteResult{offset, LIBUSB_SUCCESS})
+                {
+                }
+            };
+
+            /// WriteQueue holds the write requests waiting to be combined.
+            struct WriteQueue {
+                std::atomic<WriteRequest*> head{nullptr};
+                std::atomic<bool> combining{false};
+            };
+
+            /// PollfdNotifiers holds the functions registered by setPollfdNotifiers.
+            struct PollfdNotifiers {
+                std::function<void(libusb_pollfd)> added;
+                std::function<void(int32_t)> removed;
+            };
+
+            /// onPollfdAdded is called by libusb when a file descriptor is added.
+            static void LIBUSB_CALL onPollfdAdded(int fd, short events, void* userData) {
+                const auto notifiers = static_cast<PollfdNotifiers*>(userData);
+                if (notifiers->added) {
+                    notifiers->added(libusb_pollfd{fd, events});
+                }
+            }
+
+            /// onPollfdRemoved is called by libusb when a file descriptor is removed.
+            static void LIBUSB_CALL onPollfdRemoved(int fd, void* userData) {
+                const auto notifiers = static_cast<PollfdNotifiers*>(userData);
+                if (notifiers->removed) {
+                    notifiers->removed(static_cast<int32_t>(fd));
+                }
+            }
+
+            struct TransferList;
+
+            /// Transfer holds an asynchronous transfer's state.
+            /// Read transfers have a read handler, and own the buffer which receives the packets.
+            struct Transfer {
+                libusb_transfer* usbTransfer;
+                std::function<void(libusb_transfer_status, std::size_t)> handler;
+                Counters* counters;
+                TransferList* transfers;
+                std::chrono::steady_clock::time_point begin;
+                std::size_t sent;
+                std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, ReadStatus)> readHandler;
+                BasicChip* chip;
+                DeviceBuffer packets;
+                ReadStatus readStatus;
+            };
+
+            /// TransferList holds the asynchronous transfers in flight, the transfers parked during a recovery,
+            /// and the completed transfers kept for reuse.
+            struct TransferList {
+                std::vector<Transfer*> inFlight;
+                std::vector<Transfer*> parked;
+                bool recovering = false;
+                bool closing = false;
+                std::vector<uint8_t> bytes;
+                std::vector<DeviceBuffer> packetsPool;
+                std::vector<Transfer*> transferPool;
+
+                /// takeTransfer returns a pooled transfer, or allocates one (with its libusb transfer) if the pool is empty.
+                Transfer* takeTransfer() {
+                    if (!transferPool.empty()) {
+                        const auto transfer = transferPool.back();
+                        transferPool.pop_back();
+                        return transfer;
+                    }
+                    auto transfer = std::unique_ptr<Transfer>(new Transfer());
+                    transfer->usbTransfer = libusb_alloc_transfer(0);
+                    if (transfer->usbTransfer == nullptr) {
+                        throw std::runtime_error("allocating a transfer failed");
+                    }
+                    return transfer.release();
+                }
+
+                /// release clears a transfer's handlers, and returns it to the pool.
+                void release(Transfer* transfer) {
+                    transfer->handler = nullptr;
+                    transfer->readHandler = nullptr;
+                    transferPool.push_back(transfer);
+                }
+
+                /// takePackets returns a pooled read buffer, or allocates and pre-faults one if the pool is empty.
+                /// The parsed bytes' vector is grown beforehand, so that completions do not allocate memory.
+                DeviceBuffer takePackets(libusb_device_handle* usbHandle, std::size_t capacity) {
+                    bytes.reserve(capacity);
+                    while (!packetsPool.empty()) {
+                        auto packets = std::move(packetsPool.back());
+                        packetsPool.pop_back();
+                        if (packets.capacity() == capacity) {
+                            return packets;
+                        }
+                    }
+                    auto packets = DeviceBuffer(usbHandle, capacity);
+                    packets.prefault();
+                    return packets;
+                }
+
+                /// remove forgets a transfer which is no longer in flight.
+                void remove(Transfer* transfer) {
+                    inFlight.erase(std::find(inFlight.begin(), inFlight.end(), transfer));
+                }
+            };
+
+            /// onWriteCompleted is called by libusb when an asynchronous write transfer completes.
+            /// Transfers which do not complete during a recovery are parked, to be resubmitted.
+            static void LIBUSB_CALL onWriteCompleted(libusb_transfer* usbTransfer) {
+                auto transfer = static_cast<Transfer*>(usbTransfer->user_data);
+                const auto status = usbTransfer->status;
+                transfer->sent += static_cast<std::size_t>(usbTransfer->actual_length);
+                transfer->counters->countWrite(
+                    static_cast<std::size_t>(usbTransfer->length),
+                    static_cast<std::size_t>(usbTransfer->actual_length),
+                    status == LIBUSB_TRANSFER_TIMED_OUT,
+                    transfer->begin
+                );
+                transfer->transfers->remove(transfer);
+                if (transfer->transfers->recovering && status != LIBUSB_TRANSFER_COMPLETED) {
+                    transfer->transfers->parked.push_back(transfer);
+                    return;
+                }
+                complete(transfer, status);
+            }
+
+            /// onReadCompleted is called by libusb when an asynchronous read transfer completes.
+            /// Transfers which do not complete during a recovery are parked, to be resubmitted.
+            static void LIBUSB_CALL onReadCompleted(libusb_transfer* usbTransfer) {
+                auto transfer = static_cast<Transfer*>(usbTransfer->user_data);
+                const auto status = usbTransfer->status;
+                transfer->sent = static_cast<std::size_t>(usbTransfer->actual_length);
+                transfer->readStatus.stamp(transfer->counters->readTransfers.fetch_add(1, std::memory_order_relaxed));
+                transfer->counters->record(transfer->counters->readLatencies, transfer->begin);
+                if (status == LIBUSB_TRANSFER_TIMED_OUT) {
+                    transfer->counters->timeouts.fetch_add(1, std::memory_order_relaxed);
+                }
+                transfer->transfers->remove(transfer);
+                if (transfer->transfers->recovering && status != LIBUSB_TRANSFER_COMPLETED) {
+                    transfer->transfers->parked.push_back(transfer);
+                    return;
+                }
+                complete(transfer, status);
+            }
+
+            /// complete returns an asynchronous transfer to the pool and calls its handler (unless the chip is being destroyed).
+            /// The handler is moved out of the transfer beforehand, since it may submit a transfer which reuses it.
+            /// The packets received by a read transfer are parsed into a vector shared by the read transfers,
+            /// valid until the handler returns.
+            static void complete(Transfer* transfer, libusb_transfer_status status) {
+                const auto transfers = transfer->transfers;
+                if (transfers->closing) {
+                    transfers->packetsPool.push_back(std::move(transfer->packets));
+                    transfers->release(transfer);
+                    return;
+                }
+                if (transfer->readHandler) {
+                    auto readHandler = std::move(transfer->readHandler);
+                    auto packets = std::move(transfer->packets);
+                    auto readStatus = transfer->readStatus;
+                    const auto size = transfer->sent;
+                    const auto chip = transfer->chip;
+                    const auto counters = transfer->counters;
+                    transfers->release(transfer);
+                    auto& bytes = transfers->bytes;
+                    bytes.clear();
+                    chip->parsePackets(packets.data(), size, bytes, readStatus);
+                    transfers->packetsPool.push_back(std::move(packets));
+                    counters->bytesRead.fetch_add(bytes.size(), std::memory_order_relaxed);
+                    readHandler(status, bytes, readStatus);
+                } else {
+                    auto handler = std::move(transfer->handler);
+                    const auto sent = transfer->sent;
+                    transfers->release(transfer);
+                    if (handler) {
+                        handler(status, sent);
+                    }
+                }
+            }
+
+            /// parsePackets copies the payloads of the packets read with a transfer to bytes, and handles their status bytes.
+            void parsePackets(const uint8_t* packets, std::size_t size, std::vector<uint8_t>& bytes, ReadStatus& status) {
+                // remove the status bytes with the kernel matching the negotiated packet size
+                if (_packetSize == Configuration::packetSize()) {
+                    removeStatusBytes<Configuration::packetSize()>(packets, size, bytes, status);
+                } else if (_packetSize == HighSpeed::packetSize()) {
+                    removeStatusBytes<HighSpeed::packetSize()>(packets, size, bytes, status);
+                } else {
+                    removeStatusBytes<FullSpeed::packetSize()>(packets, size, bytes, status);
+                }
+                if (status.overrun()) {
+                    _counters->overruns.fetch_add(1, std::memory_order_relaxed);
+                    if (_overrunHandler) {
+                        _overrunHandler(status);
+                    }
+                }
+                if (status.parityError() || status.framingError() || status.breakInterrupt()) {
+                    _counters->lineErrors.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            /// removeStatusBytes combines the status bytes of the packets read with a transfer of the given size,
+            /// and copies the packets' payloads to bytes.
+            /// The packet size is a template parameter, so that the compiler can specialize the loops.
+            template <std::size_t packetSize>
+            void removeStatusBytes(const uint8_t* packets, std::size_t size, std::vector<uint8_t>& bytes, ReadStatus& status) {
+                constexpr auto statusSize = Configuration::statusSize();
+                constexpr auto payloadSize = packetSize - statusSize;
+
+                // combine the status bytes
+                status.modemStatus = 0;
+                status.lineStatus = 0;
+                for (std::size_t packetIndex = 0; packetIndex * packetSize + 1 < size; ++packetIndex) {
+                    status.modemStatus |= packets[packetSize * packetIndex];
+                    status.lineStatus |= packets[packetSize * packetIndex + 1];
+                }
+
+                // copy the payloads
+                if (size > statusSize) {
+                    const auto fullPackets = size / packetSize;
+                    const auto lastPacketSize = size % packetSize;
+                    bytes.reserve(payloadSize * fullPackets + (lastPacketSize > statusSize ? lastPacketSize - statusSize : 0));
+                    for (std::size_t packetIndex = 0; packetIndex < fullPackets; ++packetIndex) {
+                        bytes.insert(
+                            bytes.end(),
+                            packets + packetSize * packetIndex + statusSize,
+                            packets + packetSize * (packetIndex + 1)
+                        );
+                    }
+                    if (lastPacketSize > statusSize) {
+                        bytes.insert(bytes.end(), packets + size - lastPacketSize + statusSize, packets + size);
+                    }
+                    if (lastPacketSize > 0) {
+                        _counters->shortPackets.fetch_add(1, std::memory_order_relaxed);
+                    }
+                } else {
+                    _counters->statusOnlyReads.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            /// checkUsbError throws an exception if the returned code is not zero.
+            static void checkUsbError(int32_t error, std::string message) {
+                if (error != 0) {
+                    throw std::runtime_error(message + " failed with the error " + libusb_error_name(error));
+                }
+            }
+
+            /// checkUsbTransferError throws an exception if the returned code is negative or if the unexpected number of bytes is transferred.
+            static void checkUsbTransferError(int32_t error, std::size_t expectedLength, std::string message) {
+                if (error < 0) {
+                    throw std::runtime_error(message + " failed with the error " + libusb_error_name(error));
+                }
+                if (error != expectedLength) {
+                    throw std::runtime_error(
+                        message
+                        + " failed (expected a transfer of "
+                        + std::to_string(expectedLength)
+                        + " bytes, transferred "
+                        + std::to_string(error)
+                        + ")"
+                    );
+                }
+            }
+
+            /// checkSize throws an error if the expected number of bytes is not equal to the actual number of bytes.
+            static void checkSize(std::size_t expected, int32_t actual, std::string message) {
+                if (expected != actual) {
+                    throw std::runtime_error(message + " failed (expected " + std::to_string(expected) + " bytes, got " + std::to_string(actual) + " bytes");
+                }
+            }
+
+            /// chunkSize returns the chunk size used when reading and writting data.
+            std::size_t chunkSize() const {
+                return _transferSize;
+            }
+
+            /// inputRequestType returns the libusb type for input requests.
+            static uint8_t inputRequestType() {
+                return static_cast<uint8_t>(LIBUSB_REQUEST_TYPE_VENDOR) | static_cast<uint8_t>(LIBUSB_RECIPIENT_DEVICE) | static_cast<uint8_t>(LIBUSB_ENDPOINT_IN);
+            }
+
+            /// outputRequestType returns the libusb type for output requests.
+            static uint8_t outputRequestType() {
+                return static_cast<uint8_t>(LIBUSB_REQUEST_TYPE_VENDOR) | static_cast<uint8_t>(LIBUSB_RECIPIENT_DEVICE) | static_cast<uint8_t>(LIBUSB_ENDPOINT_OUT);
+            }
+
+            /// writeBuffered sends bytes to the chip, starting at the given offset, or stores them in the write buffer.
+            /// It must be called by one thread at a time.
+            WriteResult writeBuffered(const std::vector<uint8_t>& bytes, bool flush, std::size_t offset) {
+                auto begin = bytes.data() + offset;
+                const auto end = bytes.data() + bytes.size();
+                auto result = WriteResult{offset, LIBUSB_SUCCESS};
+
+                // complete the buffer
+                if (!_writeBuffer.empty()) {
+                    const auto spaceLeft = chunkSize() - _writeBuffer.size();
+                    if (static_cast<std::size_t>(end - begin) < spaceLeft) {
+                        _writeBuffer.append(begin, end - begin);
+                        result.accepted = bytes.size();
+                        if (flush) {
+                            result.error = transferBuffer();
+                        }
+                        _counters->bufferedBytes.store(_writeBuffer.size(), std::memory_order_relaxed);
+                        return result;
+                    } else {
+                        _writeBuffer.append(begin, spaceLeft);
+                        begin += spaceLeft;
+                        result.accepted = begin - bytes.data();
+                        result.error = transferBuffer();
+                        if (!result.complete()) {
+                            _counters->bufferedBytes.store(_writeBuffer.size(), std::memory_order_relaxed);
+                            return result;
+                        }
+                    }
+                }
+
+                // send complete chunks
+                while (static_cast<std::size_t>(end - begin) >= chunkSize()) {
+                    const auto chunkResult = transferOut(begin, chunkSize());
+                    result.accepted += chunkResult.accepted;
+                    if (!chunkResult.complete()) {
+                        result.error = chunkResult.error;
+                        _counters->bufferedBytes.store(_writeBuffer.size(), std::memory_order_relaxed);
+                        return result;
+                    }
+                    begin += chunkSize();
+                }
+
+                // flush the extra bytes or fill the buffer
+                if (begin != end) {
+                    if (flush) {
+                        const auto extraResult = transferOut(begin, end - begin);
+                        result.accepted += extraResult.accepted;
+                        result.error = extraResult.error;
+                    } else {
+                        _writeBuffer.append(begin, end - begin);
+                        result.accepted = bytes.size();
+                    }
+                }
+                _counters->bufferedBytes.store(_writeBuffer.size(), std::memory_order_relaxed);
+                return result;
+            }
+
+            /// transferBuffer sends the write buffer, and removes the sent bytes from it.
+            /// The bytes which were not sent stay in the buffer, and are sent with the next transfer.
+            int32_t transferBuffer() {
+                const auto result = transferOut(_writeBuffer.data(), _writeBuffer.size());
+                _writeBuffer.consume(result.accepted);
+                return result.error;
+            }
+
+            /// combine processes write requests, from the oldest to the newest.
+            /// The requests form a list from the newest to the oldest.
+            /// The requests' bytes are coalesced in the write buffer, which is sent once at the end of the batch if a request asked for a flush.
+            /// If a transfer fails, the following requests of the batch are not processed, and report the same error.
+            void combine(WriteRequest* requests) {
+                WriteRequest* previous = nullptr;
+                while (requests != nullptr) {
+                    const auto next = requests->next;
+                    requests->next = previous;
+                    previous = requests;
+                    requests = next;
+                }
+                auto flush = false;
+                auto error = static_cast<int32_t>(LIBUSB_SUCCESS);
+                for (auto request = previous; request != nullptr; request = request->next) {
+                    if (error != LIBUSB_SUCCESS) {
+                        request->result.error = error;
+                        continue;
+                    }
+                    flush |= request->flush;
+                    try {
+                        request->result = writeBuffered(request->bytes, false, request->offset);
+                        error = request->result.error;
+                    } catch (...) {
+                        request->exception = std::current_exception();
+                    }
+                }
+                if (flush && error == LIBUSB_SUCCESS) {
+                    try {
+                        error = writeBuffered(std::vector<uint8_t>(), true, 0).error;
+                    } catch (...) {
+                        for (auto request = previous; request != nullptr; request = request->next) {
+                            if (request->flush && !request->exception) {
+                                request->exception = std::current_exception();
+                            }
+                        }
+                    }
+                }
+                while (previous != nullptr) {
+
+                    // the request may be destroyed by its thread as soon as it is done and its mutex is released
+                    const auto next = previous->next;
+                    if (previous->flush && previous->result.complete()) {
+                        previous->result.error = error;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(previous->mutex);
+                        previous->done.store(true, std::memory_order_release);
+                        previous->condition.notify_one();
+                    }
+                    previous = next;
+                }
+            }
+
+            /// transferOut sends bytes to the chip with a single bulk transfer, and returns the number of bytes sent.
+            virtual WriteResult transferOut(const uint8_t* bytes, std::size_t size) {
+                int32_t bytesSent = 0;
+                const auto begin = std::chrono::steady_clock::now();
+                const auto error = libusb_bulk_transfer(
+                    _usbHandle,
+                    Configuration::outEndpoint(),
+                    const_cast<uint8_t*>(bytes),
+                    static_cast<int32_t>(size),
+                    &bytesSent,
+                    _timeout
+                );
+                _counters->countWrite(size, static_cast<std::size_t>(bytesSent), error == LIBUSB_ERROR_TIMEOUT, begin);
+                if (error == LIBUSB_SUCCESS && static_cast<std::size_t>(bytesSent) != size) {
+                    return WriteResult{static_cast<std::size_t>(bytesSent), LIBUSB_ERROR_IO};
+                }
+                return WriteResult{static_cast<std::size_t>(bytesSent), error};
+            }
+
+            /// open finds and opens the device with the chip's vendor id, product id and id (any id if empty).
+            libusb_device_handle* open() {
+                libusb_device** usbDevices;
+                const auto numberOfDevices = libusb_get_device_list(_usbContext, &usbDevices);
+                if (numberOfDevices < 0) {
+                    throw std::runtime_error("getting the devices list failed");
+                }
+                libusb_device_handle* usbHandle = nullptr;
+                try {
+                    for (std::size_t index = 0; index < static_cast<std::size_t>(numberOfDevices); ++index) {
+                        libusb_device_descriptor descriptor;
+                        const auto error = libusb_get_device_descriptor(usbDevices[index], &descriptor);
+                        if (error != 0) {
+                            throw std::runtime_error("retrieving the device descriptor failed with the error " + std::to_string(error));
+                        }
+                        if (descriptor.idVendor == _vendorId && descriptor.idProduct == _productId) {
+                            const auto error = libusb_open(usbDevices[index], &usbHandle);
+                            if (error != 0) {
+                                throw std::runtime_error("opening the device failed with the error " + std::to_string(error));
+                            }
+                            if (_id.empty() || readId(usbHandle) == _id) {
+                                break;
+                            }
+                            libusb_close(usbHandle);
+                            usbHandle = nullptr;
+                        }
+                    }
+                } catch (...) {
+                    if (usbHandle != nullptr) {
+                        libusb_close(usbHandle);
+                    }
+                    libusb_free_device_list(usbDevices, 1);
+                    throw;
+                }
+                libusb_free_device_list(usbDevices, 1);
+                if (usbHandle == nullptr) {
+                    if (_id.empty()) {
+                        throw std::runtime_error("no device with the correct vendor and product ids could be find");
+                    }
+                    throw std::runtime_error("the requested device could not be found");
+                }
+                return usbHandle;
+            }
+
+            /// readId retrieves the id stored in the chip's eeprom.
+            static std::string readId(libusb_device_handle* usbHandle) {
+                auto id = std::string();
+                for (auto registerIndex = static_cast<uint16_t>(86); registerIndex < 128; ++registerIndex) {
+                    auto buffer = std::array<uint8_t, 2>{};
+                    checkUsbTransferError(libusb_control_transfer(
+                        usbHandle,
+                        inputRequestType(),
+                        0x90,
+                        0,
+                        registerIndex,
+                        buffer.data(),
+                        buffer.size(),
+                        5000
+                    ), buffer.size(), "reading the eeprom");
+                    if (std::get<0>(buffer) == 0x10 && std::get<1>(buffer) == 0x03) {
+                        break;
+                    }
+                    id.push_back(std::get<0>(buffer));
+                }
+                return id;
+            }
+
+            /// swap exchanges the states of two chips, and points their transfers to their new owner.
+            /// The moved-from chip does not own a device, hence its destructor does not close the device twice.
+            void swap(BasicChip& other) {
+                std::swap(_timeout, other._timeout);
+                std::swap(_vendorId, other._vendorId);
+                std::swap(_productId, other._productId);
+                std::swap(_id, other._id);
+                std::swap(_usbContext, other._usbContext);
+                std::swap(_usbHandle, other._usbHandle);
+                std::swap(_speed, other._speed);
+                std::swap(_packetSize, other._packetSize);
+                std::swap(_transferSize, other._transferSize);
+                std::swap(_readBuffer, other._readBuffer);
+                std::swap(_writeBuffer, other._writeBuffer);
+                std::swap(_counters, other._counters);
+                std::swap(_writeQueue, other._writeQueue);
+                std::swap(_transfers, other._transfers);
+                std::swap(_pollfdNotifiers, other._pollfdNotifiers);
+                std::swap(_overrunHandler, other._overrunHandler);
+                adoptTransfers();
+                other.adoptTransfers();
+            }
+
+            /// adoptTransfers points the chip's transfers (in flight, parked and pooled) to the chip.
+            void adoptTransfers() {
+                if (!_transfers) {
+                    return;
+                }
+                for (auto transfers : {&_transfers->inFlight, &_transfers->parked, &_transfers->transferPool}) {
+                    for (auto transfer : *transfers) {
+                        transfer->chip = this;
+                    }
+                }
+            }
+
+            /// Link holds the properties negotiated by a configured device.
+            struct Link {
+                libusb_speed speed;
+                std::size_t packetSize;
+                std::size_t transferSize;
+            };
+
+            /// connect opens and configures the device, and allocates the read and write buffers.
+            /// It is called by the constructors, hence libusb is released if it fails.
+            void connect(bool purge) {
+                try {
+                    _usbHandle = open();
+                    const auto link = configure(_usbHandle, purge);
+                    _speed = link.speed;
+                    _packetSize = link.packetSize;
+                    _transferSize = link.transferSize;
+                    _readBuffer = DeviceBuffer(_usbHandle, chunkSize());
+                    _readBuffer.prefault();
+                    _writeBuffer = DeviceBuffer(_usbHandle, chunkSize());
+                    _writeBuffer.prefault();
+                } catch (...) {
+                    _readBuffer = DeviceBuffer();
+                    _writeBuffer = DeviceBuffer();
+                    if (_usbHandle != nullptr) {
+                        libusb_close(_usbHandle);
+                        _usbHandle = nullptr;
+                    }
+                    libusb_exit(_usbContext);
+                    _usbContext = nullptr;
+                    throw;
+                }
+            }
+
+            /// configure prepares a device for the FT245 style synchronous FIFO mode, and returns the negotiated properties.
+            /// If purge is true, the bytes left in the chip's buffers by a previous session are discarded.
+            /// The packet and transfer sizes are adapted to the negotiated speed.
+            /// The chip's members are not modified. If the configuration fails, the interface is released but the handle is not closed.
+            Link configure(libusb_device_handle* usbHandle, bool purge) const {
+                auto link = Link{};
+                {
+                    libusb_detach_kernel_driver(usbHandle, 0);
+                    const auto error = libusb_claim_interface(usbHandle, 0);
+                    if (error == LIBUSB_ERROR_BUSY) {
+                        throw std::runtime_error("the requested device is busy");
+                    } else {
+                        checkUsbError(error, "claiming the interface");
+                    }
+                }
+                try {
+                    const auto usbDevice = libusb_get_device(usbHandle);
+                    link.speed = static_cast<libusb_speed>(libusb_get_device_speed(usbDevice));
+                    const auto maximumPacketSize = libusb_get_max_packet_size(usbDevice, Configuration::inEndpoint());
+                    if (maximumPacketSize < 0) {
+                        checkUsbError(maximumPacketSize, "retrieving the packet size");
+                    }
+                    link.packetSize = static_cast<std::size_t>(maximumPacketSize);
+                    if (
+                        link.packetSize != Configuration::packetSize()
+                        && link.packetSize != HighSpeed::packetSize()
+                        && link.packetSize != FullSpeed::packetSize()
+                    ) {
+                        throw std::runtime_error("the packet size " + std::to_string(link.packetSize) + " is not supported");
+                    }
+
+                    // the transfer size is the one of the configuration matching the negotiated packet size
+                    if (link.packetSize == Configuration::packetSize()) {
+                        link.transferSize = Configuration::transferSize();
+                    } else if (link.packetSize == HighSpeed::packetSize()) {
+                        link.transferSize = HighSpeed::transferSize();
+                    } else {
+                        link.transferSize = FullSpeed::transferSize();
+                    }
+
+                    checkUsbTransferError(
+                        libusb_control_transfer(usbHandle, outputRequestType(), 0, 0, 1, nullptr, 0, _timeout),
+                        0,
+                        "resetting the device"
+                    );
+                    checkUsbTransferError(
+                        libusb_control_transfer(usbHandle, outputRequestType(), 11, 16639, 1, nullptr, 0, _timeout),
+                        0,
+                        "setting the bitmode"
+                    );
+                    checkUsbTransferError(
+                        libusb_control_transfer(usbHandle, outputRequestType(), 1, 257, 1, nullptr, 0, _timeout),
+                        0,
+                        "enabling the data-terminal-ready line"
+                    );
+                    checkUsbTransferError(
+                        libusb_control_transfer(usbHandle, outputRequestType(), 1, 547, 1, nullptr, 0, _timeout),
+                        0,
+                        "clearing the request-to-send line"
+                    );
+                    checkUsbTransferError(
+                        libusb_control_transfer(usbHandle, outputRequestType(), 2, 0, 257, nullptr, 0, _timeout),
+                        0,
+                        "enabling the flow control"
+                    );
+                    checkUsbTransferError(
+                        libusb_control_transfer(usbHandle, outputRequestType(), 9, 16, 1, nullptr, 0, _timeout),
+                        0,
+                        "setting the latency timer"
+                    );
+                    if (purge) {
+                        checkUsbTransferError(
+                            libusb_control_transfer(usbHandle, outputRequestType(), 0, 2, 1, nullptr, 0, _timeout),
+                            0,
+                            "purging the receive buffer"
+                        );
+                        checkUsbTransferError(
+                            libusb_control_transfer(usbHandle, outputRequestType(), 0, 1, 1, nullptr, 0, _timeout),
+                            0,
+                            "purging the transmit buffer"
+                        );
+                    }
+                } catch (...) {
+                    libusb_release_interface(usbHandle, 0);
+                    throw;
+                }
+                return link;
+            }
+
+            uint32_t _timeout;
+            uint16_t _vendorId;
+            uint16_t _productId;
+            std::string _id;
+            libusb_context* _usbContext;
+            libusb_device_handle* _usbHandle;
+            libusb_speed _speed;
+            std::size_t _packetSize;
+            std::size_t _transferSize;
+            DeviceBuffer _readBuffer;
+            DeviceBuffer _writeBuffer;
+            std::unique_ptr<Counters> _counters;
+            std::unique_ptr<WriteQueue> _writeQueue;
+            std::unique_ptr<TransferList> _transfers;
+            std::unique_ptr<PollfdNotifiers> _pollfdNotifiers;
+            std::function<void(ReadStatus)> _overrunHandler;
+    };
+
+    /// Chip represents a FT232H chip connected to a high-speed USB port.
+    using Chip = BasicChip<HighSpeed>;
+
+#ifdef __linux__
+
+    /// UsbfsChip is a chip which sends bulk transfers with the Linux usbfs interface (/dev/bus/usb) instead of libusb.
+    /// The device is found and configured with libusb, which is still used for control requests.
+    /// A ring of read URBs is kept in flight, and the completed URBs are reaped with epoll.
+    /// The asynchronous transfers' timeouts are checked when handleEvents is called.
+    /// recover does not reopen the device: it throws if the halt conditions cannot be cleared.
+    class UsbfsChip : public Chip {
+        public:
+            /// Configuration gives the endpoints' addresses. The packet and transfer sizes are negotiated with the device (see packetSize).
+            using Configuration = Chip::ChipConfiguration;
+
+            UsbfsChip(
+                uint32_t timeout = 5000,
+                uint16_t vendorId = 1027,
+                uint16_t productId = 24596,
+                bool purge = true,
+                std::size_t readUrbs = 8
+            ) :
+                Chip(timeout, vendorId, productId, purge)
+            {
+                initialize(readUrbs);
+            }
+            UsbfsChip(
+                std::string id,
+                uint32_t timeout = 5000,
+                uint16_t vendorId = 1027,
+                uint16_t productId = 24596,
+                bool purge = true,
+                std::size_t readUrbs = 8
+            ) :
+                Chip(id, timeout, vendorId, productId, purge)
+            {
+                initialize(readUrbs);
+            }
+            UsbfsChip(const UsbfsChip&) = delete;
+            UsbfsChip(UsbfsChip&&) = delete;
+            UsbfsChip& operator=(const UsbfsChip&) = delete;
+            UsbfsChip& operator=(UsbfsChip&&) = delete;
+            virtual ~UsbfsChip() {
+                release();
+            }
+            using Chip::read;
+            using Chip::submitRead;
+
+            /// read receives bytes from the chip and retrieves the transfer's status bytes.
+            virtual std::vector<uint8_t> read(ReadStatus& status) override {
+                auto bytes = std::vector<uint8_t>();
+                const auto begin = std::chrono::steady_clock::now();
+                const auto received = wait([this]() {
+                    return !_completedReads.empty();
+                }, begin + std::chrono::milliseconds(_timeout));
+                _counters->record(_counters->readLatencies, begin);
+                const auto sequence = _counters->readTransfers.fetch_add(1, std::memory_order_relaxed);
+                if (!received) {
+                    _counters->timeouts.fetch_add(1, std::memory_order_relaxed);
+                    checkUsbError(LIBUSB_ERROR_TIMEOUT, "reading bytes");
+                }
+                Urb* urb;
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    urb = _completedReads.front();
+                    _completedReads.pop_front();
+                }
+
+                // a failed URB is resubmitted by recover
+                checkUsbError(urbError(urb->urb.status), "reading bytes");
+                status = urb->status;
+                status.sequence = sequence;
+                parsePackets(
+                    static_cast<const uint8_t*>(urb->urb.buffer),
+                    static_cast<std::size_t>(urb->urb.actual_length),
+                    bytes,
+                    status
+                );
+                checkUsbError(submit(urb), "submitting a read");
+                _counters->bytesRead.fetch_add(bytes.size(), std::memory_order_relaxed);
+                return bytes;
+            }
+
+            /// submitWrite starts an asynchronous transfer of bytes to the chip, and returns immediately.
+            virtual void submitWrite(
+                const uint8_t* bytes,
+                std::size_t size,
+                std::function<void(libusb_transfer_status, std::size_t)> handler
+            ) override {
+                auto urb = std::unique_ptr<Urb>(new Urb());
+                fill(*urb, UrbKind::asyncWrite, Configuration::outEndpoint(), const_cast<uint8_t*>(bytes), size);
+                urb->handler = std::move(handler);
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _asyncWrites.push_back(urb.get());
+                }
+                const auto error = submit(urb.get());
+                if (error != LIBUSB_SUCCESS) {
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        _asyncWrites.erase(std::find(_asyncWrites.begin(), _asyncWrites.end(), urb.get()));
+                    }
+                    checkUsbError(error, "submitting a transfer");
+                }
+                urb.release();
+            }
+
+            /// handleEvents waits at most timeout milliseconds for asynchronous transfers to complete, and calls their handlers.
+            virtual void handleEvents(uint32_t timeout) override {
+                const auto now = std::chrono::steady_clock::now();
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    for (auto urb : _asyncWrites) {
+                        if (!urb->timedOut && now - urb->begin > std::chrono::milliseconds(_timeout)) {
+                            urb->timedOut = true;
+                            ioctl(_fd, USBDEVFS_DISCARDURB, &urb->urb);
+                        }
+                    }
+                }
+                wait([this]() {
+                    return !_completedWrites.empty() || (!_readHandlers.empty() && !_completedReads.empty());
+                }, now + std::chrono::milliseconds(timeout));
+                auto completedWrites = std::deque<Urb*>();
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    completedWrites.swap(_completedWrites);
+                }
+                while (!completedWrites.empty()) {
+                    auto urb = std::unique_ptr<Urb>(completedWrites.front());
+                    completedWrites.pop_front();
+                    const auto sent = static_cast<std::size_t>(urb->urb.actual_length);
+                    urb->sent += sent;
+                    _counters->countWrite(static_cast<std::size_t>(urb->urb.buffer_length), sent, urb->timedOut, urb->begin);
+                    if (urb->handler) {
+                        try {
+                            urb->handler(transferStatus(*urb), urb->sent);
+                        } catch (...) {
+                            std::lock_guard<std::mutex> lock(_mutex);
+                            _completedWrites.insert(_completedWrites.begin(), completedWrites.begin(), completedWrites.end());
+                            throw;
+                        }
+                    }
+                }
+                for (;;) {
+                    Urb* urb;
+                    std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, ReadStatus)> handler;
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        if (_readHandlers.empty() || _completedReads.empty()) {
+                            break;
+                        }
+                        urb = _completedReads.front();
+                        _completedReads.pop_front();
+                        handler = std::move(_readHandlers.front());
+                        _readHandlers.pop_front();
+                    }
+                    auto status = urb->status;
+                    status.sequence = _counters->readTransfers.fetch_add(1, std::memory_order_relaxed);
+                    _readBytes.clear();
+                    parsePackets(
+                        static_cast<const uint8_t*>(urb->urb.buffer),
+                        static_cast<std::size_t>(urb->urb.actual_length),
+                        _readBytes,
+                        status
+                    );
+                    const auto urbStatus = transferStatus(*urb);
+                    _counters->bytesRead.fetch_add(_readBytes.size(), std::memory_order_relaxed);
+
+                    // a failed URB is resubmitted by recover
+                    if (urb->urb.status == 0) {
+                        checkUsbError(submit(urb), "submitting a read");
+                    }
+                    handler(urbStatus, _readBytes, status);
+                }
+            }
+
+            /// submitRead queues a read. The handler is called by handleEvents with the next completed read URB.
+            /// The size is ignored, since the read URBs are allocated when the chip is created.
+            virtual void submitRead(std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, ReadStatus)> handler, std::size_t) override {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _readHandlers.push_back(std::move(handler));
+            }
+
+            /// pollfds returns the usbfs file descriptor, which is writable when URBs can be reaped.
+            virtual std::vector<libusb_pollfd> pollfds() const override {
+                return {libusb_pollfd{_fd, POLLOUT}};
+            }
+
+            /// setPollfdNotifiers does nothing, since recover does not reopen the device and the usbfs file descriptor never changes.
+            virtual void setPollfdNotifiers(std::function<void(libusb_pollfd)>, std::function<void(int32_t)>) override {}
+
+            /// nextTimeout returns the delay in milliseconds before the oldest asynchronous write times out,
+            /// or -1 if no asynchronous write is in flight.
+            virtual int32_t nextTimeout() const override {
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto result = static_cast<int64_t>(-1);
+                const auto now = std::chrono::steady_clock::now();
+                for (auto urb : _asyncWrites) {
+                    if (!urb->timedOut) {
+                        const auto remaining = std::max<int64_t>(
+                            std::chrono::duration_cast<std::chrono::milliseconds>(
+                                urb->begin + std::chrono::milliseconds(_timeout) - now
+                            ).count() + 1,
+                            0
+                        );
+                        if (result < 0 || remaining < result) {
+                            result = remaining;
+                        }
+                    }
+                }
+                return static_cast<int32_t>(result);
+            }
+
+            /// recover discards the URBs in flight, clears the endpoints' halt conditions and purges the chip's receive buffer,
+            /// then resubmits the failed read URBs and the discarded asynchronous transfers, without the bytes already sent.
+            /// Completed reads are kept, and discarded reads which received packets complete with them, as with BasicChip::recover.
+            /// The transmit buffer is not purged, since it may hold bytes acknowledged by the chip, which are not resent.
+            virtual void recover() override {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    for (auto& urb : _readUrbs) {
+                        if (urb->inFlight) {
+                            urb->parked = true;
+                            ioctl(_fd, USBDEVFS_DISCARDURB, &urb->urb);
+                        }
+                    }
+                    for (auto urb : _asyncWrites) {
+                        urb->parked = true;
+                        ioctl(_fd, USBDEVFS_DISCARDURB, &urb->urb);
+                    }
+                }
+                if (!wait([this]() {
+                    return inFlight() == 0;
+                }, std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout))) {
+                    throw std::runtime_error("cancelling the transfers in flight timed out");
+                }
+                for (auto endpoint : std::array<unsigned int, 2>{{Configuration::inEndpoint(), Configuration::outEndpoint()}}) {
+                    if (ioctl(_fd, USBDEVFS_CLEAR_HALT, &endpoint) != 0) {
+                        throw std::runtime_error(std::string("clearing the halt condition failed with the error ") + std::strerror(errno));
+                    }
+                }
+                purgeRx();
+                auto parked = std::vector<Urb*>();
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+
+                    // completed reads are kept for read, and discarded reads which received packets complete with them
+                    for (auto urbIterator = _completedReads.begin(); urbIterator != _completedReads.end();) {
+                        auto urb = *urbIterator;
+                        if (urb->parked && urb->urb.actual_length > 0) {
+                            urb->urb.status = 0;
+                        }
+                        urb->parked = false;
+                        if (urb->urb.status == 0) {
+                            ++urbIterator;
+                        } else {
+                            urbIterator = _completedReads.erase(urbIterator);
+                        }
+                    }
+                    for (auto urbIterator = _completedWrites.begin(); urbIterator != _completedWrites.end();) {
+                        auto urb = *urbIterator;
+                        if (urb->parked && urb->urb.status != 0) {
+                            const auto sent = static_cast<std::size_t>(urb->urb.actual_length);
+                            _counters->countWrite(static_cast<std::size_t>(urb->urb.buffer_length), sent, false, urb->begin);
+                            urb->sent += sent;
+                            urb->urb.buffer = static_cast<uint8_t*>(urb->urb.buffer) + sent;
+                            urb->urb.buffer_length -= static_cast<int>(sent);
+                            urb->urb.actual_length = 0;
+                            urb->urb.status = 0;
+                            if (urb->urb.buffer_length > 0) {
+                                parked.push_back(urb);
+                                _asyncWrites.push_back(urb);
+                                urbIterator = _completedWrites.erase(urbIterator);
+                                continue;
+                            }
+                        }
+                        urb->parked = false;
+                        ++urbIterator;
+                    }
+                }
+                for (auto& urb : _readUrbs) {
+                    if (std::find(_completedReads.begin(), _completedReads.end(), urb.get()) == _completedReads.end()) {
+                        checkUsbError(submit(urb.get()), "submitting a read");
+                    }
+                }
+                for (auto urb : parked) {
+                    urb->parked = false;
+                    urb->timedOut = false;
+                    const auto error = submit(urb);
+                    if (error != LIBUSB_SUCCESS) {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        _asyncWrites.erase(std::find(_asyncWrites.begin(), _asyncWrites.end(), urb));
+                        urb->urb.status = -EIO;
+                        _completedWrites.push_back(urb);
+                    }
+                }
+            }
+
+        protected:
+
+            /// UrbKind determines how a completed URB is handled.
+            enum class UrbKind {
+                read,
+                write,
+                asyncWrite,
+            };
+
+            /// Urb holds an URB and its state.
+            /// The URB is the last member, since its structure ends with a flexible array (unused by bulk transfers).
+            struct Urb {
+                UrbKind kind;
+                bool inFlight;
+                bool parked;
+                bool timedOut;
+                std::size_t sent;
+                std::chrono::steady_clock::time_point begin;
+                std::function<void(libusb_transfer_status, std::size_t)> handler;
+                ReadStatus status;
+                usbdevfs_urb urb;
+            };
+
+            /// transferOut sends bytes to the chip with a single URB, and returns the number of bytes sent.
+            virtual WriteResult transferOut(const uint8_t* bytes, std::size_t size) override {
+                Urb urb{};
+                fill(urb, UrbKind::write, Configuration::outEndpoint(), const_cast<uint8_t*>(bytes), size);
+                const auto begin = std::chrono::steady_clock::now();
+                auto error = submit(&urb);
+                if (error != LIBUSB_SUCCESS) {
+                    _counters->countWrite(size, 0, false, begin);
+                    return WriteResult{0, error};
+                }
+                const auto completed = [&urb]() {
+                    return !urb.inFlight;
+                };
+                const auto timedOut = !wait(completed, begin + std::chrono::milliseconds(_timeout));
+                if (timedOut) {
+                    ioctl(_fd, USBDEVFS_DISCARDURB, &urb.urb);
+                    wait(completed, std::chrono::steady_clock::time_point::max());
+                }
+                const auto sent = static_cast<std::size_t>(urb.urb.actual_length);
+                _counters->countWrite(size, sent, timedOut, begin);
+                if (timedOut) {
+                    error = LIBUSB_ERROR_TIMEOUT;
+                } else {
+                    error = urbError(urb.urb.status);
+                    if (error == LIBUSB_SUCCESS && sent != size) {
+                        error = LIBUSB_ERROR_IO;
+                    }
+                }
+                return WriteResult{sent, error};
+            }
+
+            /// initialize opens the usbfs device file, claims the interface and submits the read URBs.
+            void initialize(std::size_t readUrbs) {
+                if (readUrbs == 0) {
+                    throw std::runtime_error("a usbfs chip requires at least one read URB");
+                }
+                _fd = -1;
+                _epoll = -1;
+                _readMemory = nullptr;
+                _polling = false;
+                try {
+                    const auto usbDevice = libusb_get_device(_usbHandle);
+                    const auto pad = [](uint8_t value) {
+                        const auto digits = std::to_string(value);
+                        return std::string(3 - digits.size(), '0') + digits;
+                    };
+                    const auto path = "/dev/bus/usb/" + pad(libusb_get_bus_number(usbDevice)) + "/" + pad(libusb_get_device_address(usbDevice));
+                    libusb_release_interface(_usbHandle, 0);
+                    _fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+                    if (_fd < 0) {
+                        throw std::runtime_error("opening '" + path + "' failed with the error " + std::strerror(errno));
+                    }
+                    auto interface = static_cast<unsigned int>(0);
+                    if (ioctl(_fd, USBDEVFS_CLAIMINTERFACE, &interface) != 0) {
+                        throw std::runtime_error(std::string("claiming the interface failed with the error ") + std::strerror(errno));
+                    }
+                    _epoll = epoll_create1(EPOLL_CLOEXEC);
+                    if (_epoll < 0) {
+                        throw std::runtime_error(std::string("creating an epoll instance failed with the error ") + std::strerror(errno));
+                    }
+                    auto event = epoll_event{};
+                    event.events = EPOLLOUT;
+                    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, _fd, &event) != 0) {
+                        throw std::runtime_error(std::string("watching the device failed with the error ") + std::strerror(errno));
+                    }
+
+                    // use memory mapped by usbfs if possible, so that the kernel does not copy the read bytes
+                    _readMemorySize = readUrbs * chunkSize();
+                    auto memory = mmap(nullptr, _readMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+                    if (memory == MAP_FAILED) {
+                        _readMemoryFallback.resize(_readMemorySize);
+                        memory = _readMemoryFallback.data();
+                    } else {
+                        _readMemory = static_cast<uint8_t*>(memory);
+                    }
+                    for (std::size_t index = 0; index < readUrbs; ++index) {
+                        _readUrbs.emplace_back(new Urb());
+                        fill(
+                            *_readUrbs.back(),
+                            UrbKind::read,
+                            Configuration::inEndpoint(),
+                            static_cast<uint8_t*>(memory) + index * chunkSize(),
+                            chunkSize()
+                        );
+                        checkUsbError(submit(_readUrbs.back().get()), "submitting a read");
+                    }
+                } catch (...) {
+                    release();
+                    throw;
+                }
+            }
+
+            /// release discards the URBs in flight and closes the usbfs device file.
+            void release() {
+                if (_fd >= 0) {
+                    for (auto& urb : _readUrbs) {
+                        if (urb->inFlight) {
+                            ioctl(_fd, USBDEVFS_DISCARDURB, &urb->urb);
+                        }
+                    }
+                    for (auto urb : _asyncWrites) {
+                        ioctl(_fd, USBDEVFS_DISCARDURB, &urb->urb);
+                    }
+                    while (inFlight() > 0) {
+                        usbdevfs_urb* completedUrb = nullptr;
+                        if (ioctl(_fd, USBDEVFS_REAPURB, &completedUrb) != 0) {
+                            break;
+                        }
+                        collect(completedUrb);
+                    }
+                    auto interface = static_cast<unsigned int>(0);
+                    ioctl(_fd, USBDEVFS_RELEASEINTERFACE, &interface);
+                }
+                for (auto urb : _asyncWrites) {
+                    delete urb;
+                }
+                _asyncWrites.clear();
+                for (auto urb : _completedWrites) {
+                    delete urb;
+                }
+                _completedWrites.clear();
+                _completedReads.clear();
+                _readUrbs.clear();
+                if (_readMemory != nullptr) {
+                    munmap(_readMemory, _readMemorySize);
+                    _readMemory = nullptr;
+                }
+                if (_epoll >= 0) {
+                    ::close(_epoll);
+                    _epoll = -1;
+                }
+                if (_fd >= 0) {
+                    ::close(_fd);
+                    _fd = -1;
+                }
+            }
+
+            /// fill prepares a bulk URB.
+            static void fill(Urb& urb, UrbKind kind, uint8_t endpoint, uint8_t* buffer, std::size_t size) {
+                urb.urb.type = USBDEVFS_URB_TYPE_BULK;
+                urb.urb.endpoint = endpoint;
+                urb.urb.buffer = buffer;
+                urb.urb.buffer_length = static_cast<int>(size);
+                urb.urb.usercontext = &urb;
+                urb.kind = kind;
+                urb.inFlight = false;
+                urb.parked = false;
+                urb.timedOut = false;
+                urb.sent = 0;
+            }
+
+            /// submit sends an URB to the kernel, and returns a libusb error code.
+            int32_t submit(Urb* urb) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                urb->inFlight = true;
+                urb->begin = std::chrono::steady_clock::now();
+                if (ioctl(_fd, USBDEVFS_SUBMITURB, &urb->urb) != 0) {
+                    urb->inFlight = false;
+                    return urbError(-errno);
+                }
+                return LIBUSB_SUCCESS;
+            }
+
+            /// collect updates the state of a reaped URB. It must be called with the mutex locked.
+            void collect(usbdevfs_urb* completedUrb) {
+                auto urb = static_cast<Urb*>(completedUrb->usercontext);
+                urb->inFlight = false;
+                switch (urb->kind) {
+                    case UrbKind::read:
+                        urb->status.stamp(0);
+                        _completedReads.push_back(urb);
+                        break;
+                    case UrbKind::write:
+                        break;
+                    case UrbKind::asyncWrite:
+                        _asyncWrites.erase(std::find(_asyncWrites.begin(), _asyncWrites.end(), urb));
+                        _completedWrites.push_back(urb);
+                        break;
+                }
+            }
+
+            /// inFlight returns the number of read URBs and asynchronous transfers in flight.
+            /// It must be called with the mutex locked.
+            std::size_t inFlight() const {
+                return _asyncWrites.size() + static_cast<std::size_t>(std::count_if(
+                    _readUrbs.begin(),
+                    _readUrbs.end(),
+                    [](const std::unique_ptr<Urb>& urb) {
+                        return urb->inFlight;
+                    }
+                ));
+            }
+
+            /// wait reaps the completed URBs until the predicate is true or the deadline is reached.
+            /// The predicate is evaluated with the mutex locked. wait returns false if the deadline was reached.
+            /// A single thread polls the device at a time, the others wait for it to reap the URBs.
+            template <typename Predicate>
+            bool wait(Predicate predicate, std::chrono::steady_clock::time_point deadline) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                auto reaped = false;
+                while (!predicate()) {
+                    const auto now = std::chrono::steady_clock::now();
+                    if (now >= deadline) {
+
+                        // an expired deadline still reaps the URBs already completed, once
+                        if (reaped || _polling) {
+                            return false;
+                        }
+                        reaped = true;
+                        reap();
+                        continue;
+                    }
+                    if (_polling) {
+                        if (deadline == std::chrono::steady_clock::time_point::max()) {
+                            _reaped.wait(lock);
+                        } else {
+                            _reaped.wait_until(lock, deadline);
+                        }
+                        continue;
+                    }
+                    _polling = true;
+                    lock.unlock();
+                    auto event = epoll_event{};
+                    const auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+                    epoll_wait(
+                        _epoll,
+                        &event,
+                        1,
+                        deadline == std::chrono::steady_clock::time_point::max()
+                            ? -1
+                            : static_cast<int>(std::min<int64_t>(milliseconds + 1, std::numeric_limits<int>::max()))
+                    );
+                    lock.lock();
+                    _polling = false;
+                    reap();
+                }
+                return true;
+            }
+
+            /// reap collects the completed URBs without waiting, and wakes up the waiting threads.
+            /// It must be called with the mutex locked.
+            void reap() {
+                for (;;) {
+                    usbdevfs_urb* completedUrb = nullptr;
+                    if (ioctl(_fd, USBDEVFS_REAPURBNDELAY, &completedUrb) != 0) {
+                        break;
+                    }
+                    collect(completedUrb);
+                }
+                _reaped.notify_all();
+            }
+
+            /// urbError converts an URB status to a libusb error code.
+            static int32_t urbError(int status) {
+                switch (status) {
+                    case 0:
+                        return LIBUSB_SUCCESS;
+                    case -EPIPE:
+                        return LIBUSB_ERROR_PIPE;
+                    case -ENODEV:
+                    case -ESHUTDOWN:
+                        return LIBUSB_ERROR_NO_DEVICE;
+                    case -EOVERFLOW:
+                        return LIBUSB_ERROR_OVERFLOW;
+                    case -ETIMEDOUT:
+                        return LIBUSB_ERROR_TIMEOUT;
+                    case -ENOENT:
+                    case -ECONNRESET:
+                        return LIBUSB_ERROR_INTERRUPTED;
+                    case -ENOMEM:
+                        return LIBUSB_ERROR_NO_MEM;
+                    case -EBUSY:
+                        return LIBUSB_ERROR_BUSY;
+                    default:
+                        return LIBUSB_ERROR_IO;
+                }
+            }
+
+            /// transferStatus converts the state of a completed asynchronous URB to a libusb transfer status.
+            static libusb_transfer_status transferStatus(const Urb& urb) {
+                if (urb.timedOut) {
+                    return LIBUSB_TRANSFER_TIMED_OUT;
+                }
+                switch (urb.urb.status) {
+                    case 0:
+                        return LIBUSB_TRANSFER_COMPLETED;
+                    case -EPIPE:
+                        return LIBUSB_TRANSFER_STALL;
+                    case -ENODEV:
+                    case -ESHUTDOWN:
+                        return LIBUSB_TRANSFER_NO_DEVICE;
+                    case -EOVERFLOW:
+                        return LIBUSB_TRANSFER_OVERFLOW;
+                    case -ENOENT:
+                    case -ECONNRESET:
+                        return LIBUSB_TRANSFER_CANCELLED;
+                    default:
+                        return LIBUSB_TRANSFER_ERROR;
+                }
+            }
+
+            int _fd;
+            int _epoll;
+            uint8_t* _readMemory;
+            std::size_t _readMemorySize;
+            std::vector<uint8_t> _readMemoryFallback;
+            std::vector<std::unique_ptr<Urb>> _readUrbs;
+            std::deque<Urb*> _completedReads;
+            std::vector<Urb*> _asyncWrites;
+            std::deque<Urb*> _completedWrites;
+            std::deque<std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, ReadStatus)>> _readHandlers;
+            std::vector<uint8_t> _readBytes;
+            mutable std::mutex _mutex;
+            std::condition_variable _reaped;
+            bool _polling;
+    };
+
+#endif
+
+    /// Ring is a single-producer single-consumer queue of bytes.
+    /// The capacity must be a power of two. The storage is aligned on memory pages.
+    class Ring {
+        public:
+            Ring(std::size_t capacity) :
+                _capacity(capacity),
+                _storage(nullptr, &std::free),
+                _head(0),
+                _tail(0),
+                _writeIndex(0)
+            {
+                if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+                    throw std::runtime_error("the ring capacity must be a power of two");
+                }
+                void* storage = nullptr;
+                if (posix_memalign(&storage, pageSize(), capacity) != 0) {
+                    throw std::runtime_error("allocating the ring failed");
+                }
+                _storage.reset(static_cast<uint8_t*>(storage));
+            }
+            Ring(const Ring&) = delete;
+            Ring(Ring&&) = delete;
+            Ring& operator=(const Ring&) = delete;
+            Ring& operator=(Ring&&) = delete;
+            virtual ~Ring() {}
+
+            /// capacity returns the ring's size in bytes.
+            std::size_t capacity() const {
+                return _capacity;
+            }
+
+            /// writable returns the number of bytes which can be written (producer only).
+            std::size_t writable() const {
+                return _capacity - (_writeIndex - _tail.load(std::memory_order_acquire));
+            }
+
+            /// write copies bytes to the ring without making them visible to the consumer (producer only).
+            /// The number of bytes must not be larger than writable.
+            void write(const uint8_t* bytes, std::size_t size) {
+                const auto offset = _writeIndex & (_capacity - 1);
+                const auto first = std::min(size, _capacity - offset);
+                std::copy(bytes, bytes + first, _storage.get() + offset);
+                std::copy(bytes + first, bytes + size, _storage.get());
+                _writeIndex += size;
+            }
+
+            /// commit makes the written bytes visible to the consumer (producer only).
+            void commit() {
+                _head.store(_writeIndex, std::memory_order_release);
+            }
+
+            /// readable returns the number of bytes which can be read (consumer only).
+            std::size_t readable() const {
+                return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_relaxed);
+            }
+
+            /// front returns a pointer to the oldest readable byte (consumer only).
+            /// The bytes are contiguous up to the end of the storage.
+            const uint8_t* front() const {
+                return _storage.get() + (_tail.load(std::memory_order_relaxed) & (_capacity - 1));
+            }
+
+            /// contiguous returns the number of readable bytes which follow front in memory (consumer only).
+            std::size_t contiguous() const {
+                return std::min(readable(), _capacity - (_tail.load(std::memory_order_relaxed) & (_capacity - 1)));
+            }
+
+            /// peek copies readable bytes, starting offset bytes after the oldest one, without removing them (consumer only).
+            void peek(uint8_t* destination, std::size_t offset, std::size_t size) const {
+                const auto begin = (_tail.load(std::memory_order_relaxed) + offset) & (_capacity - 1);
+                const auto first = std::min(size, _capacity - begin);
+                std::copy(_storage.get() + begin, _storage.get() + begin + first, destination);
+                std::copy(_storage.get(), _storage.get() + (size - first), destination + first);
+            }
+
+            /// pop removes the oldest bytes (consumer only).
+            void pop(std::size_t size) {
+                _tail.store(_tail.load(std::memory_order_relaxed) + size, std::memory_order_release);
+            }
+
+            /// pageSize returns the size of a memory page in bytes.
+            static std::size_t pageSize() {
+                return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+            }
+
+        protected:
+            const std::size_t _capacity;
+            std::unique_ptr<uint8_t, void(*)(void*)> _storage;
+            std::atomic<std::size_t> _head;
+            std::atomic<std::size_t> _tail;
+            std::size_t _writeIndex;
+    };
+
+    /// RecorderOptions configures a recorder.
+    struct RecorderOptions {
+        /// ringSize is the size of the ring between the reading thread and the writing thread, in bytes.
+        /// It must be a power of two and a multiple of blockSize.
+        std::size_t ringSize;
+
+        /// blockSize is the number of bytes written to the file at once.
+        /// It must be a multiple of the memory page size.
+        std::size_t blockSize;
+
+        /// preallocation is the number of bytes reserved on disk each time the file grows.
+        /// It must be a multiple of blockSize.
+        std::size_t preallocation;
+
+        /// direct bypasses the operating system's page cache (O_DIRECT under Linux, F_NOCACHE under OS X).
+        bool direct;
+
+        /// mapped writes the file through a memory mapping instead of write calls.
+        /// It cannot be used along with direct.
+        bool mapped;
+
+        RecorderOptions() :
+            ringSize(1 << 26),
+            blockSize(1 << 20),
+            preallocation(1 << 28),
+            direct(false),
+            mapped(false)
+        {
+        }
+    };
+
+    /// RecorderStatistics is a snapshot of a recorder's counters.
+    struct RecorderStatistics {
+        /// recordedBytes is the number of payload bytes moved to the ring.
+        uint64_t recordedBytes;
+
+        /// writtenBytes is the number of bytes written to the file (headers included).
+        uint64_t writtenBytes;
+
+        /// droppedBytes is the number of payload bytes dropped because the ring was full.
+        uint64_t droppedBytes;
+
+        /// drops is the number of read transfers dropped because the ring was full.
+        uint64_t drops;
+    };
+
+    /// Recorder writes the bytes read from a chip to a capture file.
+    /// A reading thread moves the payloads to a ring, and a writing thread moves the ring's content to the file with large aligned writes.
+    /// The reading thread never waits for the disk: if the ring is full, the payload is dropped and the drop is counted.
+    /// The chip must not be read by other threads while the recorder is running.
+    ///
+    /// A capture file starts with the 16 characters "coyote-capture-1" followed by records.
+    /// A record is a 16 bytes header followed by the payload. The header contains, in little endian order,
+    /// the reception time in nanoseconds since the beginning of the recording (8 bytes),
+    /// the payload size (4 bytes) and the number of payload bytes dropped right before this record (4 bytes, saturated).
+    class Recorder {
+        public:
+            Recorder(Chip& chip, const std::string& filename, RecorderOptions options = RecorderOptions()) :
+                _chip(chip),
+                _options(options),
+                _ring(options.ringSize),
+                _file(-1),
+                _written(0),
+                _allocated(0),
+                _mapping(nullptr),
+                _mappingOffset(0),
+                _running(true),
+                _reading(true),
+                _recordedBytes(0),
+                _writtenBytes(0),
+                _droppedBytes(0),
+                _drops(0)
+            {
+                if (options.blockSize == 0 || options.blockSize % Ring::pageSize() != 0) {
+                    throw std::runtime_error("the block size must be a multiple of the page size");
+                }
+                if (options.ringSize % options.blockSize != 0) {
+                    throw std::runtime_error("the ring size must be a multiple of the block size");
+                }
+                if (options.preallocation == 0 || options.preallocation % options.blockSize != 0) {
+                    throw std::runtime_error("the preallocation must be a multiple of the block size");
+                }
+                if (options.direct && options.mapped) {
+                    throw std::runtime_error("a recorder cannot be both direct and mapped");
+                }
+                auto flags = (options.mapped ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+                #ifdef __linux__
+                    if (options.direct) {
+                        flags |= O_DIRECT;
+                    }
+                #endif
+                _file = ::open(filename.c_str(), flags, 0644);
+                if (_file < 0) {
+                    throw std::runtime_error("opening '" + filename + "' failed with the error " + std::strerror(errno));
+                }
+                #ifdef __APPLE__
+                    if (options.direct) {
+                        fcntl(_file, F_NOCACHE, 1);
+                    }
+                #endif
+                _ring.write(reinterpret_cast<const uint8_t*>(signature().data()), signature().size());
+                _ring.commit();
+                _begin = std::chrono::steady_clock::now();
+                _writer = std::thread(&Recorder::writeLoop, this);
+                try {
+                    _reader = std::thread(&Recorder::readLoop, this);
+                } catch (...) {
+
+                    // the writing thread terminates once the reading thread is marked as stopped
+                    _running.store(false, std::memory_order_release);
+                    _reading.store(false, std::memory_order_release);
+                    _writer.join();
+                    ::close(_file);
+                    throw;
+                }
+            }
+            Recorder(const Recorder&) = delete;
+            Recorder(Recorder&&) = delete;
+            Recorder& operator=(const Recorder&) = delete;
+            Recorder& operator=(Recorder&&) = delete;
+            virtual ~Recorder() {
+                try {
+                    stop();
+                } catch (...) {
+                }
+            }
+
+            /// stop terminates the reading thread, writes the remaining bytes and closes the file.
+            /// It rethrows the exception which interrupted the threads, if any.
+            virtual void stop() {
+                _running.store(false, std::memory_order_release);
+                if (_reader.joinable()) {
+                    _reader.join();
+                }
+                if (_writer.joinable()) {
+                    _writer.join();
+                }
+                if (_file >= 0) {
+                    ::close(_file);
+                    _file = -1;
+                }
+                if (_exception) {
+                    const auto exception = _exception;
+                    _exception = nullptr;
+                    std::rethrow_exception(exception);
+                }
+            }
+
+            /// signature returns the characters which start a capture file.
+            static const std::string& signature() {
+                static const auto signature = std::string("coyote-capture-1");
+                return signature;
+            }
+
+            /// statistics returns a snapshot of the recorder's counters.
+            /// This function can be called from any thread.
+            virtual RecorderStatistics statistics() const {
+                RecorderStatistics statistics;
+                statistics.recordedBytes = _recordedBytes.load(std::memory_order_relaxed);
+                statistics.writtenBytes = _writtenBytes.load(std::memory_order_relaxed);
+                statistics.droppedBytes = _droppedBytes.load(std::memory_order_relaxed);
+                statistics.drops = _drops.load(std::memory_order_relaxed);
+                return statistics;
+            }
+
+        protected:
+
+            /// storeLittleEndian writes an integer as little endian bytes.
+            static void storeLittleEndian(uint8_t* bytes, uint64_t value, std::size_t size) {
+                for (std::size_t index = 0; index < size; ++index) {
+                    bytes[index] = static_cast<uint8_t>((value >> (8 * index)) & 0xff);
+                }
+            }
+
+            /// fail stores the current exception and stops both threads.
+            void fail() {
+                std::lock_guard<std::mutex> lock(_exceptionMutex);
+                if (!_exception) {
+                    _exception = std::current_exception();
+                }
+                _running.store(false, std::memory_order_release);
+            }
+
+            /// readLoop moves the bytes read from the chip to the ring.
+            /// Consecutive empty reads from a finished chip (a consumed replay) are followed by an exponential back-off,
+            /// so that the thread does not spin until the recorder is stopped. Empty reads from a device are status-only transfers,
+            /// paced by the latency timer: the next read is submitted immediately, so that the chip's FIFO never stalls.
+            void readLoop() {
+                try {
+                    auto dropped = static_cast<uint64_t>(0);
+                    auto idleDelay = std::chrono::microseconds(0);
+                    std::array<uint8_t, 16> header;
+                    while (_running.load(std::memory_order_acquire)) {
+                        auto status = ReadStatus{};
+                        const auto bytes = _chip.read(status);
+                        if (bytes.empty()) {
+                            if (!_chip.finished()) {
+                                continue;
+                            }
+                            idleDelay = std::min(std::max(idleDelay * 2, std::chrono::microseconds(100)), std::chrono::microseconds(10000));
+                            std::this_thread::sleep_for(idleDelay);
+                            continue;
+                        }
+                        idleDelay = std::chrono::microseconds(0);
+                        const auto timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - _begin
+                        ).count();
+                        if (_ring.writable() < header.size() + bytes.size()) {
+                            dropped += bytes.size();
+                            _droppedBytes.fetch_add(bytes.size(), std::memory_order_relaxed);
+                            _drops.fetch_add(1, std::memory_order_relaxed);
+                            continue;
+                        }
+                        storeLittleEndian(header.data(), static_cast<uint64_t>(timestamp), 8);
+                        storeLittleEndian(header.data() + 8, bytes.size(), 4);
+                        storeLittleEndian(header.data() + 12, std::min(dropped, static_cast<uint64_t>(0xffffffff)), 4);
+                        _ring.write(header.data(), header.size());
+                        _ring.write(bytes.data(), bytes.size());
+                        _ring.commit();
+                        dropped = 0;
+                        _recordedBytes.fetch_add(bytes.size(), std::memory_order_relaxed);
+                    }
+                } catch (...) {
+                    fail();
+                }
+                _reading.store(false, std::memory_order_release);
+            }
+
+            /// writeLoop moves the ring's content to the file, one block at a time.
+            void writeLoop() {
+                try {
+                    for (;;) {
+                        const auto reading = _reading.load(std::memory_order_acquire);
+                        if (_ring.readable() >= _options.blockSize) {
+                            writeBlock(_options.blockSize);
+                        } else if (reading) {
+                            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        } else {
+                            break;
+                        }
+                    }
+                    writeBlock(_ring.readable());
+                    if (_mapping != nullptr) {
+                        munmap(_mapping, _options.preallocation);
+                        _mapping = nullptr;
+                    }
+                    if (ftruncate(_file, static_cast<off_t>(_written)) != 0) {
+                        throw std::runtime_error(std::string("resizing the file failed with the error ") + std::strerror(errno));
+                    }
+                } catch (...) {
+                    fail();
+                }
+            }
+
+            /// writeBlock writes the oldest bytes in the ring to the file.
+            /// The bytes must be contiguous in the ring, which is the case for blocks and for the final bytes.
+            void writeBlock(std::size_t size) {
+                if (size == 0) {
+                    return;
+                }
+                if (_options.mapped) {
+                    if (_mapping == nullptr || _written == _mappingOffset + _options.preallocation) {
+                        if (_mapping != nullptr) {
+                            munmap(_mapping, _options.preallocation);
+                            _mapping = nullptr;
+                            _mappingOffset += _options.preallocation;
+                        }
+                        if (ftruncate(_file, static_cast<off_t>(_mappingOffset + _options.preallocation)) != 0) {
+                            throw std::runtime_error(std::string("resizing the file failed with the error ") + std::strerror(errno));
+                        }
+                        preallocate();
+                        const auto mapping = mmap(
+                            nullptr,
+                            _options.preallocation,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED,
+                            _file,
+                            static_cast<off_t>(_mappingOffset)
+                        );
+                        if (mapping == MAP_FAILED) {
+                            throw std::runtime_error(std::string("mapping the file failed with the error ") + std::strerror(errno));
+                        }
+                        _mapping = static_cast<uint8_t*>(mapping);
+                    }
+                    std::copy(_ring.front(), _ring.front() + size, _mapping + (_written - _mappingOffset));
+                } else {
+                    if (_written + size > _allocated) {
+                        preallocate();
+                    }
+
+                    // direct writes require a size multiple of the page size, the padding is removed when the file is closed
+                    auto remaining = _options.direct ? (size + Ring::pageSize() - 1) / Ring::pageSize() * Ring::pageSize() : size;
+                    auto bytes = _ring.front();
+                    while (remaining > 0) {
+                        const auto written = ::write(_file, bytes, remaining);
+                        if (written < 0) {
+                            if (errno == EINTR) {
+                                continue;
+                            }
+                            throw std::runtime_error(std::string("writing to the file failed with the error ") + std::strerror(errno));
+                        }
+                        bytes += written;
+                        remaining -= static_cast<std::size_t>(written);
+                    }
+                }
+                _ring.pop(size);
+                _written += size;
+                _writtenBytes.store(_written, std::memory_order_relaxed);
+            }
+
+            /// preallocate reserves disk space for the next bytes of the file.
+            /// Failures are ignored, since preallocation is only a performance optimisation.
+            void preallocate() {
+                const auto begin = _options.mapped ? _mappingOffset : _allocated;
+                #ifdef __linux__
+                    posix_fallocate(_file, static_cast<off_t>(begin), static_cast<off_t>(_options.preallocation));
+                #elif defined(__APPLE__)
+                    fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, static_cast<off_t>(_options.preallocation), 0};
+                    if (fcntl(_file, F_PREALLOCATE, &store) == -1) {
+                        store.fst_flags = F_ALLOCATEALL;
+                        fcntl(_file, F_PREALLOCATE, &store);
+                    }
+                #endif
+                _allocated = begin + _options.preallocation;
+            }
+
+            Chip& _chip;
+            const RecorderOptions _options;
+            Ring _ring;
+            int _file;
+            std::size_t _written;
+            std::size_t _allocated;
+            uint8_t* _mapping;
+            std::size_t _mappingOffset;
+            std::chrono::steady_clock::time_point _begin;
+            std::atomic<bool> _running;
+            std::atomic<bool> _reading;
+            std::atomic<uint64_t> _recordedBytes;
+            std::atomic<uint64_t> _writtenBytes;
+            std::atomic<uint64_t> _droppedBytes;
+            std::atomic<uint64_t> _drops;
+            std::mutex _exceptionMutex;
+            std::exception_ptr _exception;
+            std::thread _reader;
+            std::thread _writer;
+    };
+
+    /// CaptureRecord is a view on a record stored in a capture file (see Recorder).
+    struct CaptureRecord {
+        /// begin points to the first byte of the payload.
+        const uint8_t* begin;
+
+        /// end points after the last byte of the payload.
+        const uint8_t* end;
+
+        /// timestamp is the reception time in nanoseconds since the beginning of the recording.
+        uint64_t timestamp;
+
+        /// dropped is the number of payload bytes dropped by the recorder right before this record.
+        uint32_t dropped;
+    };
+
+    /// ReplayChip reads the bytes stored in a capture file (see Recorder) instead of a device.
+    /// The file is memory mapped: next returns views on the mapping without copying the payloads,
+    /// whereas read copies them to implement the Chip interface.
+    /// If paced is true, the records are returned at the pace of the original recording. Otherwise, they are returned as fast as possible.
+    /// If loop is true, the file is replayed indefinitely. Otherwise, read returns empty vectors once the file has been consumed.
+    /// Bytes written to a ReplayChip go through the write buffer, and are discarded instead of being sent.
+    class ReplayChip : public Chip {
+        public:
+            ReplayChip(const std::string& filename, bool paced = false, bool loop = false) :
+                Chip(nullptr, nullptr, 0),
+                _paced(paced),
+                _loop(loop),
+                _mapping(nullptr),
+                _size(0),
+                _end(0),
+                _offset(Recorder::signature().size()),
+                _previousTimestamp(0),
+                _started(false)
+            {
+                const auto file = ::open(filename.c_str(), O_RDONLY);
+                if (file < 0) {
+                    throw std::runtime_error("opening '" + filename + "' failed with the error " + std::strerror(errno));
+                }
+                const auto size = lseek(file, 0, SEEK_END);
+                if (size < static_cast<off_t>(Recorder::signature().size())) {
+                    ::close(file);
+                    throw std::runtime_error("'" + filename + "' is not a capture file");
+                }
+                const auto mapping = mmap(nullptr, static_cast<std::size_t>(size), PROT_READ, MAP_PRIVATE, file, 0);
+                ::close(file);
+                if (mapping == MAP_FAILED) {
+                    throw std::runtime_error("mapping '" + filename + "' failed with the error " + std::strerror(errno));
+                }
+                _mapping = static_cast<const uint8_t*>(mapping);
+                _size = static_cast<std::size_t>(size);
+                _end = _size;
+                if (!std::equal(Recorder::signature().begin(), Recorder::signature().end(), _mapping)) {
+                    munmap(const_cast<uint8_t*>(_mapping), _size);
+                    throw std::runtime_error("'" + filename + "' is not a capture file");
+                }
+                madvise(const_cast<uint8_t*>(_mapping), _size, MADV_SEQUENTIAL);
+            }
+            ReplayChip(const ReplayChip&) = delete;
+            ReplayChip(ReplayChip&&) = delete;
+            ReplayChip& operator=(const ReplayChip&) = delete;
+            ReplayChip& operator=(ReplayChip&&) = delete;
+            virtual ~ReplayChip() {
+                munmap(const_cast<uint8_t*>(_mapping), _size);
+            }
+
+            using Chip::read;
+            using Chip::submitRead;
+
+            /// read copies the next record's payload.
+            /// The status bytes are not stored in capture files, hence they are always zero.
+            /// The timestamps are those of the replay, not of the recording (see CaptureRecord::timestamp).
+            virtual std::vector<uint8_t> read(ReadStatus& status) override {
+                const auto record = next();
+                status = replayStatus();
+                return std::vector<uint8_t>(record.begin, record.end);
+            }
+
+            /// next returns a view on the next record's payload, valid as long as the replay chip exists.
+            /// The returned record is empty if the file has been consumed.
+            virtual CaptureRecord next() {
+                if (_offset + 16 > _end) {
+                    if (!_loop || _end < Recorder::signature().size() + 16) {
+                        return CaptureRecord{_mapping + _end, _mapping + _end, _previousTimestamp, 0};
+                    }
+                    _offset = Recorder::signature().size();
+                    _begin += std::chrono::nanoseconds(_previousTimestamp);
+                }
+                const auto header = _mapping + _offset;
+                const auto size = static_cast<std::size_t>(loadLittleEndian(header + 8, 4));
+                if (_offset + 16 + size > _end) {
+
+                    // a truncated record (interrupted recording) ends the file
+                    _end = _offset;
+                    return next();
+                }
+                auto record = CaptureRecord{
+                    header + 16,
+                    header + 16 + size,
+                    loadLittleEndian(header, 8),
+                    static_cast<uint32_t>(loadLittleEndian(header + 12, 4)),
+                };
+                _offset += 16 + size;
+                if (!_started) {
+                    _started = true;
+                    _begin = std::chrono::steady_clock::now();
+                }
+                if (_paced) {
+                    std::this_thread::sleep_until(_begin + std::chrono::nanoseconds(record.timestamp));
+                }
+                _previousTimestamp = record.timestamp;
+                _counters->readTransfers.fetch_add(1, std::memory_order_relaxed);
+                _counters->bytesRead.fetch_add(size, std::memory_order_relaxed);
+                return record;
+            }
+
+            /// finished returns true if the file has been consumed.
+            /// It always returns false if the replay loops.
+            virtual bool finished() const override {
+                return !_loop && _offset + 16 > _end;
+            }
+
+            /// submitWrite discards the bytes. The handler is called by the next call to handleEvents.
+            virtual void submitWrite(
+                const uint8_t*,
+                std::size_t size,
+                std::function<void(libusb_transfer_status, std::size_t)> handler
+            ) override {
+                _counters->writeTransfers.fetch_add(1, std::memory_order_relaxed);
+                _counters->bytesWritten.fetch_add(size, std::memory_order_relaxed);
+                _completedWrites.emplace_back(std::move(handler), size);
+            }
+
+            /// submitRead queues a read. The handler is called by the next call to handleEvents, with the next record's payload.
+            /// The size is ignored, since records are replayed as they were captured.
+            virtual void submitRead(std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, ReadStatus)> handler, std::size_t) override {
+                _pendingReads.push_back(std::move(handler));
+            }
+
+            /// handleEvents calls the handlers of the discarded asynchronous transfers and of the queued reads.
+            virtual void handleEvents(uint32_t) override {
+                auto completedWrites = std::move(_completedWrites);
+                _completedWrites.clear();
+                for (auto& handlerAndSize : completedWrites) {
+                    if (handlerAndSize.first) {
+                        handlerAndSize.first(LIBUSB_TRANSFER_COMPLETED, handlerAndSize.second);
+                    }
+                }
+                auto pendingReads = std::move(_pendingReads);
+                _pendingReads.clear();
+                for (auto& handler : pendingReads) {
+                    const auto record = next();
+                    _readBytes.assign(record.begin, record.end);
+                    handler(LIBUSB_TRANSFER_COMPLETED, _readBytes, replayStatus());
+                }
+            }
+
+            /// pollfds returns an empty list, since a replay chip has no file descriptor to watch.
+            virtual std::vector<libusb_pollfd> pollfds() const override {
+                return {};
+            }
+
+            /// setPollfdNotifiers does nothing, since a replay chip has no file descriptor to watch.
+            virtual void setPollfdNotifiers(std::function<void(libusb_pollfd)>, std::function<void(int32_t)>) override {}
+
+            /// nextTimeout returns 0 if handlers are waiting to be called, and -1 otherwise.
+            virtual int32_t nextTimeout() const override {
+                return _completedWrites.empty() && _pendingReads.empty() ? -1 : 0;
+            }
+
+            /// setLatencyTimer does nothing.
+            virtual void setLatencyTimer(uint8_t) override {}
+
+            /// purgeRx does nothing.
+            virtual void purgeRx() override {}
+
+            /// purgeTx does nothing.
+            virtual void purgeTx() override {}
+
+            /// recover does nothing.
+            virtual void recover() override {}
+
+        protected:
+
+            /// transferOut discards the bytes.
+            virtual WriteResult transferOut(const uint8_t*, std::size_t size) override {
+                _counters->countWrite(size, size, false, std::chrono::steady_clock::now());
+                return WriteResult{size, LIBUSB_SUCCESS};
+            }
+
+            /// replayStatus returns the status of the last record returned by next, stamped with the current time.
+            ReadStatus replayStatus() const {
+                auto status = ReadStatus{};
+                status.stamp(_counters->readTransfers.load(std::memory_order_relaxed) - 1);
+                return status;
+            }
+
+            /// loadLittleEndian reads an integer stored as little endian bytes.
+            static uint64_t loadLittleEndian(const uint8_t* bytes, std::size_t size) {
+                auto value = static_cast<uint64_t>(0);
+                for (std::size_t index = 0; index < size; ++index) {
+                    value |= static_cast<uint64_t>(bytes[index]) << (8 * index);
+                }
+                return value;
+            }
+
+            const bool _paced;
+            const bool _loop;
+            const uint8_t* _mapping;
+            std::size_t _size;
+            std::size_t _end;
+            std::size_t _offset;
+            uint64_t _previousTimestamp;
+            bool _started;
+            std::chrono::steady_clock::time_point _begin;
+            std::vector<std::pair<std::function<void(libusb_transfer_status, std::size_t)>, std::size_t>> _completedWrites;
+            std::vector<std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, ReadStatus)>> _pendingReads;
+            std::vector<uint8_t> _readBytes;
+    };
+
+    /// PlayerOptions configures a player.
+    struct PlayerOptions {
+        /// transfers is the number of asynchronous transfers in flight.
+        std::size_t transfers;
+
+        /// transferSize is the maximum number of bytes sent by a transfer.
+        std::size_t transferSize;
+
+        /// rate is the maximum number of bytes sent per second, or zero to send the bytes as fast as possible.
+        double rate;
+
+        /// loop determines whether the file is sent indefinitely (until stop is called).
+        bool loop;
+
+        PlayerOptions() :
+            transfers(8),
+            transferSize(65536),
+            rate(0),
+            loop(false)
+        {
+        }
+    };
+
+    /// PlayerReport summarises a playback.
+    struct PlayerReport {
+        /// bytes is the number of bytes sent.
+        uint64_t bytes;
+
+        /// duration is the playback duration in seconds.
+        double duration;
+
+        /// throughput is the achieved number of bytes sent per second.
+        double throughput;
+
+        /// underruns is the number of times the chip was left without pending transfers while bytes were due.
+        uint64_t underruns;
+    };
+
+    /// Player sends the content of a file to a chip.
+    /// The file is memory mapped and sent without copies, with several asynchronous transfers in flight to keep the USB bus busy.
+    class Player {
+        public:
+            Player(Chip& chip, const std::string& filename, PlayerOptions options = PlayerOptions()) :
+                _chip(chip),
+                _options(options),
+                _mapping(nullptr),
+                _size(0),
+                _running(true)
+            {
+                if (options.transfers == 0 || options.transferSize == 0) {
+                    throw std::runtime_error("a player requires at least one transfer of at least one byte");
+                }
+                const auto file = ::open(filename.c_str(), O_RDONLY);
+                if (file < 0) {
+                    throw std::runtime_error("opening '" + filename + "' failed with the error " + std::strerror(errno));
+                }
+                const auto size = lseek(file, 0, SEEK_END);
+                if (size <= 0) {
+                    ::close(file);
+                    throw std::runtime_error("'" + filename + "' is empty");
+                }
+                const auto mapping = mmap(nullptr, static_cast<std::size_t>(size), PROT_READ, MAP_PRIVATE, file, 0);
+                ::close(file);
+                if (mapping == MAP_FAILED) {
+                    throw std::runtime_error("mapping '" + filename + "' failed with the error " + std::strerror(errno));
+                }
+                _mapping = static_cast<const uint8_t*>(mapping);
+                _size = static_cast<std::size_t>(size);
+                madvise(const_cast<uint8_t*>(_mapping), _size, MADV_SEQUENTIAL);
+            }
+            Player(const Player&) = delete;
+            Player(Player&&) = delete;
+            Player& operator=(const Player&) = delete;
+            Player& operator=(Player&&) = delete;
+            virtual ~Player() {
+                munmap(const_cast<uint8_t*>(_mapping), _size);
+            }
+
+            /// play sends the file, and returns once it has been sent or once stop has been called.
+            /// The bytes waiting in the chip's write buffer are sent first.
+            virtual PlayerReport play() {
+                _chip.write(std::vector<uint8_t>());
+                auto offset = static_cast<std::size_t>(0);
+                auto submitted = static_cast<uint64_t>(0);
+                auto sent = static_cast<uint64_t>(0);
+                auto underruns = static_cast<uint64_t>(0);
+                auto inFlight = static_cast<std::size_t>(0);
+                auto failure = LIBUSB_TRANSFER_COMPLETED;
+                const auto begin = std::chrono::steady_clock::now();
+                const auto due = [&]() {
+                    return begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(submitted / _options.rate)
+                    );
+                };
+                const auto handler = [&](libusb_transfer_status status, std::size_t size) {
+                    --inFlight;
+                    sent += size;
+                    if (status != LIBUSB_TRANSFER_COMPLETED && failure == LIBUSB_TRANSFER_COMPLETED) {
+                        failure = status;
+                    }
+                    if (
+                        inFlight == 0
+                        && failure == LIBUSB_TRANSFER_COMPLETED
+                        && _running.load(std::memory_order_acquire)
+                        && (offset < _size || _options.loop)
+                        && (_options.rate <= 0 || std::chrono::steady_clock::now() >= due())
+                    ) {
+                        ++underruns;
+                    }
+                };
+                try {
+                    for (;;) {
+                        if (
+                            inFlight < _options.transfers
+                            && failure == LIBUSB_TRANSFER_COMPLETED
+                            && _running.load(std::memory_order_acquire)
+                            && (offset < _size || _options.loop)
+                        ) {
+                            if (_options.rate > 0) {
+                                const auto now = std::chrono::steady_clock::now();
+                                if (now < due()) {
+                                    if (inFlight == 0) {
+                                        std::this_thread::sleep_until(due());
+                                    } else {
+                                        _chip.handleEvents(static_cast<uint32_t>(std::max(
+                                            std::chrono::duration_cast<std::chrono::milliseconds>(due() - now).count(),
+                                            static_cast<std::chrono::milliseconds::rep>(1)
+                                        )));
+                                    }
+                                    continue;
+                                }
+                            }
+                            if (offset == _size) {
+                                offset = 0;
+                            }
+                            const auto size = std::min(_options.transferSize, _size - offset);
+                            _chip.submitWrite(_mapping + offset, size, handler);
+                            ++inFlight;
+                            offset += size;
+                            submitted += size;
+                            continue;
+                        }
+                        if (inFlight == 0) {
+                            break;
+                        }
+                        _chip.handleEvents(100);
+                    }
+                } catch (...) {
+
+                    // the pending transfers point to the mapping and to this frame, and must complete before the exception propagates
+                    // errors raised while waiting for them are ignored, since the first exception is rethrown
+                    while (inFlight > 0) {
+                        try {
+                            _chip.handleEvents(100);
+                        } catch (...) {
+                        }
+                    }
+                    throw;
+                }
+                if (failure != LIBUSB_TRANSFER_COMPLETED) {
+                    throw std::runtime_error("playing the file failed with the transfer status " + std::to_string(failure));
+                }
+                const auto duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                return PlayerReport{sent, duration, duration > 0 ? sent / duration : 0, underruns};
+            }
+
+            /// stop interrupts play.
+            /// This function can be called from any thread.
+            virtual void stop() {
+                _running.store(false, std::memory_order_release);
+            }
+
+        protected:
+            Chip& _chip;
+            const PlayerOptions _options;
+            const uint8_t* _mapping;
+            std::size_t _size;
+            std::atomic<bool> _running;
+    };
+
+    /// RecordDescriptor describes the records in a stream of bytes.
+    /// Records either have a fixed size, or a header containing a length field.
+    struct RecordDescriptor {
+        /// size is the records size in bytes, or zero for length-prefixed records.
+        std::size_t size;
+
+        /// lengthOffset is the length field's position in the record, in bytes.
+        std::size_t lengthOffset;
+
+        /// lengthWidth is the length field's size in bytes (from 1 to 8).
+        std::size_t lengthWidth;
+
+        /// lengthAdjustment is added to the length field's value to calculate the record size.
+        /// For instance, it is the header size if the length field does not count the header.
+        int64_t lengthAdjustment;
+
+        /// bigEndian determines the length field's byte order.
+        bool bigEndian;
+
+        /// maximumSize is the largest accepted record size, which protects against corrupted length fields.
+        std::size_t maximumSize;
+
+        /// fixed returns the descriptor of records with a fixed size.
+        static RecordDescriptor fixed(std::size_t size) {
+            return RecordDescriptor{size, 0, 0, 0, false, size};
+        }
+
+        /// lengthPrefixed returns the descriptor of records with a length field.
+        static RecordDescriptor lengthPrefixed(
+            std::size_t lengthOffset,
+            std::size_t lengthWidth,
+            int64_t lengthAdjustment = 0,
+            bool bigEndian = false,
+            std::size_t maximumSize = 1 << 20
+        ) {
+            return RecordDescriptor{0, lengthOffset, lengthWidth, lengthAdjustment, bigEndian, maximumSize};
+        }
+    };
+
+    /// Framer splits a stream of bytes into records.
+    /// The records which fit in a pushed range are passed to the handler as views on the range, without copies.
+    /// Only the records which straddle two ranges are copied to an internal buffer.
+    class Framer {
+        public:
+            Framer(RecordDescriptor descriptor) :
+                _descriptor(descriptor),
+                _headerSize(descriptor.size > 0 ? descriptor.size : descriptor.lengthOffset + descriptor.lengthWidth)
+            {
+                if (descriptor.size == 0 && (descriptor.lengthWidth == 0 || descriptor.lengthWidth > 8)) {
+                    throw std::runtime_error("the length field must have between 1 and 8 bytes");
+                }
+                if (_headerSize == 0) {
+                    throw std::runtime_error("the records size must be larger than zero");
+                }
+                _pending.reserve(descriptor.size > 0 ? descriptor.size : _headerSize);
+            }
+            Framer(const Framer&) = default;
+            Framer(Framer&&) = default;
+            Framer& operator=(const Framer&) = default;
+            Framer& operator=(Framer&&) = default;
+            virtual ~Framer() {}
+
+            /// push splits bytes into records, and calls handleRecord(const uint8_t* begin, const uint8_t* end) for each complete record.
+            /// The views are valid only during the handler call. The bytes of an incomplete record are kept until the next push.
+            /// If a header holds an invalid length, push throws and discards the incomplete record, so that the next push starts a new record.
+            template <typename HandleRecord>
+            void push(const uint8_t* begin, const uint8_t* end, HandleRecord handleRecord) {
+                auto position = begin;
+
+                // complete the pending record
+                if (!_pending.empty()) {
+                    if (_pending.size() < _headerSize) {
+                        const auto taken = std::min(_headerSize - _pending.size(), static_cast<std::size_t>(end - position));
+                        _pending.insert(_pending.end(), position, position + taken);
+                        position += taken;
+                        if (_pending.size() < _headerSize) {
+                            return;
+                        }
+                    }
+                    auto size = static_cast<std::size_t>(0);
+                    try {
+                        size = recordSize(_pending.data());
+                    } catch (...) {
+                        _pending.clear();
+                        throw;
+                    }
+                    const auto taken = std::min(size - _pending.size(), static_cast<std::size_t>(end - position));
+                    _pending.insert(_pending.end(), position, position + taken);
+                    position += taken;
+                    if (_pending.size() < size) {
+                        return;
+                    }
+                    handleRecord(static_cast<const uint8_t*>(_pending.data()), static_cast<const uint8_t*>(_pending.data() + size));
+                    _pending.clear();
+                }
+
+                // pass the complete records without copies
+                while (static_cast<std::size_t>(end - position) >= _headerSize) {
+                    const auto size = recordSize(position);
+                    if (static_cast<std::size_t>(end - position) < size) {
+                        break;
+                    }
+                    handleRecord(position, position + size);
+                    position += size;
+                }
+                _pending.assign(position, end);
+            }
+
+            /// read receives bytes from a source (such as a chip) and pushes them.
+            template <typename Source, typename HandleRecord>
+            void read(Source& source, HandleRecord handleRecord) {
+                const auto bytes = source.read();
+                push(bytes.data(), bytes.data() + bytes.size(), handleRecord);
+            }
+
+            /// pending returns the number of bytes of the incomplete record.
+            std::size_t pending() const {
+                return _pending.size();
+            }
+
+            /// reset discards the bytes of the incomplete record, for instance after a purge.
+            void reset() {
+                _pending.clear();
+            }
+
+        protected:
+
+            /// recordSize calculates the size of the record starting with the given header.
+            std::size_t recordSize(const uint8_t* header) const {
+                if (_descriptor.size > 0) {
+                    return _descriptor.size;
+                }
+                auto length = static_cast<uint64_t>(0);
+                for (std::size_t index = 0; index < _descriptor.lengthWidth; ++index) {
+                    const auto byte = static_cast<uint64_t>(header[_descriptor.lengthOffset + index]);
+                    if (_descriptor.bigEndian) {
+                        length = (length << 8) | byte;
+                    } else {
+                        length |= byte << (8 * index);
+                    }
+                }
+                const auto size = static_cast<int64_t>(length) + _descriptor.lengthAdjustment;
+                if (size < static_cast<int64_t>(_headerSize) || static_cast<std::size_t>(size) > _descriptor.maximumSize) {
+                    throw std::runtime_error("invalid record size " + std::to_string(size));
+                }
+                return static_cast<std::size_t>(size);
+            }
+
+            RecordDescriptor _descriptor;
+            std::size_t _headerSize;
+            std::vector<uint8_t> _pending;
+    };
+
+    /// Overflow determines what happens to the records which do not fit in a channel's ring.
+    enum class Overflow {
+        /// block waits for the channel's consumer, which delays the other channels.
+        /// Records larger than the ring (minus a 4 bytes header) can never fit, and are dropped.
+        block,
+
+        /// drop discards the record and counts it.
+        drop,
+    };
+
+    /// ChannelStatistics is a snapshot of a demultiplexer channel's counters.
+    struct ChannelStatistics {
+        /// records is the number of records passed to the channel's handler.
+        uint64_t records;
+
+        /// bytes is the number of bytes passed to the channel's handler.
+        uint64_t bytes;
+
+        /// droppedRecords is the number of records discarded because the channel's ring was full, or too small to ever hold them.
+        uint64_t droppedRecords;
+    };
+
+    /// Demultiplexer reads records from a chip and dispatches them to channels, according to a tag in the records.
+    /// Each channel has its own ring and consumer thread, hence a slow channel which drops records does not delay the others.
+    /// The chip must not be read by other threads while the demultiplexer is running.
+    class Demultiplexer {
+        public:
+            Demultiplexer(Chip& chip, RecordDescriptor descriptor, std::size_t tagOffset, std::size_t tagWidth = 1) :
+                _chip(chip),
+                _framer(descriptor),
+                _tagOffset(tagOffset),
+                _tagWidth(tagWidth),
+                _running(false),
+                _reading(false),
+                _unroutedRecords(0)
+            {
+                if (tagWidth == 0 || tagWidth > 8) {
+                    throw std::runtime_error("the tag must have between 1 and 8 bytes");
+                }
+                if ((descriptor.size > 0 && tagOffset + tagWidth > descriptor.size)) {
+                    throw std::runtime_error("the tag must be part of the record");
+                }
+            }
+            Demultiplexer(const Demultiplexer&) = delete;
+            Demultiplexer(Demultiplexer&&) = delete;
+            Demultiplexer& operator=(const Demultiplexer&) = delete;
+            Demultiplexer& operator=(Demultiplexer&&) = delete;
+            virtual ~Demultiplexer() {
+                try {
+                    stop();
+                } catch (...) {
+                }
+            }
+
+            /// addChannel registers a handler for the records with the given tag (little endian).
+            /// The handler is called from the channel's thread with views on the records, valid only during the call.
+            /// Channels must be added before start is called.
+            virtual void addChannel(
+                uint64_t tag,
+                std::function<void(const uint8_t*, const uint8_t*)> handleRecord,
+                Overflow overflow = Overflow::drop,
+                std::size_t ringSize = 1 << 22
+            ) {
+                if (_running.load(std::memory_order_acquire)) {
+                    throw std::runtime_error("channels cannot be added to a running demultiplexer");
+                }
+                if (_indexByTag.find(tag) != _indexByTag.end()) {
+                    throw std::runtime_error("the tag " + std::to_string(tag) + " is already used by a channel");
+                }
+                _indexByTag.insert(std::make_pair(tag, _channels.size()));
+                _channels.emplace_back(new Channel(std::move(handleRecord), overflow, ringSize));
+            }
+
+            /// start launches the reading thread and the channels threads.
+            virtual void start() {
+                if (_running.exchange(true)) {
+                    throw std::runtime_error("the demultiplexer is already running");
+                }
+                _reading.store(true, std::memory_order_release);
+                for (auto& channel : _channels) {
+                    channel->thread = std::thread(&Demultiplexer::consume, this, channel.get());
+                }
+                _reader = std::thread(&Demultiplexer::read, this);
+            }
+
+            /// stop terminates the threads once the records already read have been handled.
+            /// It rethrows the exception which interrupted a thread, if any.
+            virtual void stop() {
+                _running.store(false, std::memory_order_release);
+                if (_reader.joinable()) {
+                    _reader.join();
+                }
+                for (auto& channel : _channels) {
+                    channel->condition.notify_one();
+                    if (channel->thread.joinable()) {
+                        channel->thread.join();
+                    }
+                }
+                if (_exception) {
+                    const auto exception = _exception;
+                    _exception = nullptr;
+                    std::rethrow_exception(exception);
+                }
+            }
+
+            /// statistics returns a snapshot of the counters of the channel with the given tag.
+            /// This function can be called from any thread.
+            virtual ChannelStatistics statistics(uint64_t tag) const {
+                const auto tagAndIndex = _indexByTag.find(tag);
+                if (tagAndIndex == _indexByTag.end()) {
+                    throw std::runtime_error("no channel uses the tag " + std::to_string(tag));
+                }
+                const auto& channel = _channels[tagAndIndex->second];
+                return ChannelStatistics{
+                    channel->records.load(std::memory_order_relaxed),
+                    channel->bytes.load(std::memory_order_relaxed),
+                    channel->droppedRecords.load(std::memory_order_relaxed),
+                };
+            }
+
+            /// unroutedRecords returns the number of records discarded because no channel uses their tag.
+            virtual uint64_t unroutedRecords() const {
+                return _unroutedRecords.load(std::memory_order_relaxed);
+            }
+
+        protected:
+
+            /// Channel holds a channel's ring, thread and counters.
+            struct Channel {
+                std::function<void(const uint8_t*, const uint8_t*)> handleRecord;
+                Overflow overflow;
+                Ring ring;
+                std::mutex mutex;
+                std::condition_variable condition;
+                std::thread thread;
+                bool touched;
+                std::atomic<uint64_t> records;
+                std::atomic<uint64_t> bytes;
+                std::atomic<uint64_t> droppedRecords;
+
+                Channel(std::function<void(const uint8_t*, const uint8_t*)> handleRecord, Overflow overflow, std::size_t ringSize) :
+                    handleRecord(std::move(handleRecord)),
+                    overflow(overflow),
+                    ring(ringSize),
+                    touched(false),
+                    records(0),
+                    bytes(0),
+                    droppedRecords(0)
+                {
+                }
+            };
+
+            /// fail stores the current exception and stops the threads.
+            void fail() {
+                std::lock_guard<std::mutex> lock(_exceptionMutex);
+                if (!_exception) {
+                    _exception = std::current_exception();
+                }
+                _running.store(false, std::memory_order_release);
+            }
+
+            /// read frames the bytes read from the chip and moves the records to the channels rings.
+            void read() {
+                try {
+                    while (_running.load(std::memory_order_acquire)) {
+                        _framer.read(_chip, [&](const uint8_t* begin, const uint8_t* end) {
+                            const auto size = static_cast<std::size_t>(end - begin);
+                            if (size < _tagOffset + _tagWidth) {
+                                _unroutedRecords.fetch_add(1, std::memory_order_relaxed);
+                                return;
+                            }
+                            auto tag = static_cast<uint64_t>(0);
+                            for (std::size_t index = 0; index < _tagWidth; ++index) {
+                                tag |= static_cast<uint64_t>(begin[_tagOffset + index]) << (8 * index);
+                            }
+                            const auto tagAndIndex = _indexByTag.find(tag);
+                            if (tagAndIndex == _indexByTag.end()) {
+                                _unroutedRecords.fetch_add(1, std::memory_order_relaxed);
+                                return;
+                            }
+                            auto& channel = *_channels[tagAndIndex->second];
+                            if (4 + size > channel.ring.capacity()) {
+                                channel.droppedRecords.fetch_add(1, std::memory_order_relaxed);
+                                return;
+                            }
+                            while (channel.ring.writable() < 4 + size) {
+                                if (channel.overflow == Overflow::drop || !_running.load(std::memory_order_acquire)) {
+                                    channel.droppedRecords.fetch_add(1, std::memory_order_relaxed);
+                                    return;
+                                }
+                                publish(channel);
+                                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                            }
+                            const auto header = std::array<uint8_t, 4>{{
+                                static_cast<uint8_t>(size & 0xff),
+                                static_cast<uint8_t>((size >> 8) & 0xff),
+                                static_cast<uint8_t>((size >> 16) & 0xff),
+                                static_cast<uint8_t>((size >> 24) & 0xff),
+                            }};
+                            channel.ring.write(header.data(), header.size());
+                            channel.ring.write(begin, size);
+                            channel.touched = true;
+                        });
+
+                        // publish the records once per read, to wake up the consumers once per read
+                        for (auto& channel : _channels) {
+                            if (channel->touched) {
+                                channel->touched = false;
+                                publish(*channel);
+                            }
+                        }
+                    }
+                } catch (...) {
+                    fail();
+                }
+                _reading.store(false, std::memory_order_release);
+                for (auto& channel : _channels) {
+                    std::lock_guard<std::mutex> lock(channel->mutex);
+                    channel->condition.notify_one();
+                }
+            }
+
+            /// publish makes the records written to a channel's ring visible to its consumer, and wakes it up.
+            /// The ring is committed with the channel's mutex locked, so that the wake-up cannot be missed by a consumer about to wait.
+            void publish(Channel& channel) {
+                {
+                    std::lock_guard<std::mutex> lock(channel.mutex);
+                    channel.ring.commit();
+                }
+                channel.condition.notify_one();
+            }
+
+            /// consume passes the records in a channel's ring to its handler.
+            void consume(Channel* channel) {
+                try {
+                    auto buffer = std::vector<uint8_t>();
+                    for (;;) {
+                        if (channel->ring.readable() == 0) {
+                            std::unique_lock<std::mutex> lock(channel->mutex);
+                            channel->condition.wait(lock, [&]() {
+                                return channel->ring.readable() > 0 || !_reading.load(std::memory_order_acquire);
+                            });
+                            if (channel->ring.readable() == 0) {
+                                break;
+                            }
+                            continue;
+                        }
+                        auto header = std::array<uint8_t, 4>();
+                        channel->ring.peek(header.data(), 0, header.size());
+                        channel->ring.pop(header.size());
+                        const auto size =
+                            static_cast<std::size_t>(header[0])
+                            | (static_cast<std::size_t>(header[1]) << 8)
+                            | (static_cast<std::size_t>(header[2]) << 16)
+                            | (static_cast<std::size_t>(header[3]) << 24);
+                        if (channel->ring.contiguous() >= size) {
+                            channel->handleRecord(channel->ring.front(), channel->ring.front() + size);
+                        } else {
+                            buffer.resize(size);
+                            channel->ring.peek(buffer.data(), 0, size);
+                            channel->handleRecord(buffer.data(), buffer.data() + size);
+                        }
+                        channel->ring.pop(size);
+                        channel->records.fetch_add(1, std::memory_order_relaxed);
+                        channel->bytes.fetch_add(size, std::memory_order_relaxed);
+                    }
+                } catch (...) {
+                    fail();
+                }
+            }
+
+            Chip& _chip;
+            Framer _framer;
+            const std::size_t _tagOffset;
+            const std::size_t _tagWidth;
+            std::atomic<bool> _running;
+            std::atomic<bool> _reading;
+            std::atomic<uint64_t> _unroutedRecords;
+            std::vector<std::unique_ptr<Channel>> _channels;
+            std::unordered_map<uint64_t, std::size_t> _indexByTag;
+            std::mutex _exceptionMutex;
+            std::exception_ptr _exception;
+            std::thread _reader;
+    };
+
+    /// LaneStatistics is a snapshot of a write scheduler lane's counters.
+    struct LaneStatistics {
+        /// messages is the number of messages sent.
+        uint64_t messages;
+
+        /// bytes is the number of bytes sent.
+        uint64_t bytes;
+
+        /// queuedBytes is the number of bytes waiting to be sent.
+        uint64_t queuedBytes;
+    };
+
+    /// WriteScheduler sends messages from several named lanes to a chip, from a dedicated thread.
+    /// Lanes with a strict priority are served first, from the highest priority to the lowest.
+    /// The other lanes share the remaining bandwidth according to their weights (deficit round robin).
+    /// Messages from several lanes are packed into transfers of at most transferSize bytes.
+    /// Messages which do not fit in the space left in a transfer are split at its end, so that urgent messages wait for at most one transfer,
+    /// even behind a large upload. The pieces of a message are sent in order, but other lanes' messages may be sent between them.
+    /// The chip must not be written by other threads while the scheduler is running.
+    class WriteScheduler {
+        public:
+            WriteScheduler(Chip& chip, std::size_t transferSize = 65536, std::size_t quantum = 1024) :
+                _chip(chip),
+                _transferSize(transferSize),
+                _quantum(quantum),
+                _running(true),
+                _writing(false),
+                _queuedBytes(0),
+                _cursor(0)
+            {
+                if (transferSize == 0 || quantum == 0) {
+                    throw std::runtime_error("the transfer size and the quantum must be larger than zero");
+                }
+                _thread = std::thread(&WriteScheduler::run, this);
+            }
+            WriteScheduler(const WriteScheduler&) = delete;
+            WriteScheduler(WriteScheduler&&) = delete;
+            WriteScheduler& operator=(const WriteScheduler&) = delete;
+            WriteScheduler& operator=(WriteScheduler&&) = delete;
+            virtual ~WriteScheduler() {
+                try {
+                    stop();
+                } catch (...) {
+                }
+            }
+
+            /// addLane declares a lane.
+            /// A lane with a non-zero priority is served before the weighted lanes and the lanes with a lower priority.
+            /// The weight determines the share of bandwidth of lanes without priority.
+            virtual void addLane(const std::string& name, std::size_t weight, uint32_t priority = 0) {
+                if (priority == 0 && weight == 0) {
+                    throw std::runtime_error("a lane without priority must have a non-zero weight");
+                }
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_indexByName.find(name) != _indexByName.end()) {
+                    throw std::runtime_error("the lane '" + name + "' already exists");
+                }
+                _indexByName.insert(std::make_pair(name, _lanes.size()));
+                _lanes.emplace_back(weight, priority);
+                if (priority > 0) {
+                    _prioritizedLanes.insert(
+                        std::upper_bound(_prioritizedLanes.begin(), _prioritizedLanes.end(), priority, [&](uint32_t value, std::size_t laneIndex) {
+                            return value > _lanes[laneIndex].priority;
+                        }),
+                        _lanes.size() - 1
+                    );
+                } else {
+                    _weightedLanes.push_back(_lanes.size() - 1);
+                }
+            }
+
+            /// send queues a message on the given lane, and returns immediately.
+            /// This function can be called from any thread.
+            virtual void send(const std::string& name, std::vector<uint8_t> message) {
+                if (message.empty()) {
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    throwOnFailure();
+                    auto& lane = _lanes[index(name)];
+                    _queuedBytes += message.size();
+                    lane.queuedBytes += message.size();
+                    lane.messages.push_back(std::move(message));
+                }
+                _condition.notify_one();
+            }
+
+            /// flush waits until all the queued messages have been sent.
+            virtual void flush() {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _idleCondition.wait(lock, [&]() {
+                    return (_queuedBytes == 0 && !_writing) || _exception;
+                });
+                throwOnFailure();
+            }
+
+            /// stop sends the queued messages and terminates the thread.
+            /// It rethrows the exception which interrupted the thread, if any.
+            virtual void stop() {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _running = false;
+                }
+                _condition.notify_one();
+                if (_thread.joinable()) {
+                    _thread.join();
+                }
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_exception) {
+                    const auto exception = _exception;
+                    _exception = nullptr;
+                    std::rethrow_exception(exception);
+                }
+            }
+
+            /// statistics returns a snapshot of the given lane's counters.
+            virtual LaneStatistics statistics(const std::string& name) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                const auto& lane = _lanes[index(name)];
+                return LaneStatistics{lane.sentMessages, lane.sentBytes, lane.queuedBytes};
+            }
+
+        protected:
+
+            /// Lane holds a lane's queue and counters.
+            struct Lane {
+                std::size_t weight;
+                uint32_t priority;
+                std::deque<std::vector<uint8_t>> messages;
+                std::size_t offset;
+                int64_t deficit;
+                bool credited;
+                uint64_t sentMessages;
+                uint64_t sentBytes;
+                uint64_t queuedBytes;
+
+                Lane(std::size_t weight, uint32_t priority) :
+                    weight(weight),
+                    priority(priority),
+                    offset(0),
+                    deficit(0),
+                    credited(false),
+                    sentMessages(0),
+                    sentBytes(0),
+                    queuedBytes(0)
+                {
+                }
+            };
+
+            /// index returns the index of the lane with the given name (the mutex must be locked).
+            std::size_t index(const std::string& name) const {
+                const auto nameAndIndex = _indexByName.find(name);
+                if (nameAndIndex == _indexByName.end()) {
+                    throw std::runtime_error("the lane '" + name + "' does not exist");
+                }
+                return nameAndIndex->second;
+            }
+
+            /// throwOnFailure rethrows the exception which interrupted the thread, if any (the mutex must be locked).
+            void throwOnFailure() const {
+                if (_exception) {
+                    std::rethrow_exception(_exception);
+                }
+            }
+
+            /// pick returns the index of the lane whose next bytes must be sent (the mutex must be locked, and a message must be queued).
+            /// A weighted lane is picked as long as its deficit is positive. The bytes it sends are charged to its deficit,
+            /// which may become negative when a message is larger than the deficit: the debt is repaid by the next rounds' credits.
+            std::size_t pick() {
+                for (auto laneIndex : _prioritizedLanes) {
+                    if (!_lanes[laneIndex].messages.empty()) {
+                        return laneIndex;
+                    }
+                }
+                for (;;) {
+                    auto& lane = _lanes[_weightedLanes[_cursor]];
+                    if (!lane.messages.empty()) {
+                        if (!lane.credited) {
+                            lane.deficit += static_cast<int64_t>(_quantum * lane.weight);
+                            lane.credited = true;
+                        }
+                        if (lane.deficit > 0) {
+                            return _weightedLanes[_cursor];
+                        }
+                    } else {
+                        lane.deficit = 0;
+                    }
+                    lane.credited = false;
+                    _cursor = (_cursor + 1) % _weightedLanes.size();
+                }
+            }
+
+            /// run packs queued messages into transfers and sends them.
+            /// Each pick takes the rest of the lane's oldest message, or as many of its bytes as fit in the transfer.
+            void run() {
+                auto transfer = std::vector<uint8_t>();
+                transfer.reserve(_transferSize);
+                std::unique_lock<std::mutex> lock(_mutex);
+                for (;;) {
+                    _condition.wait(lock, [&]() {
+                        return _queuedBytes > 0 || !_running;
+                    });
+                    if (_queuedBytes == 0) {
+                        break;
+                    }
+                    transfer.clear();
+                    while (_queuedBytes > 0 && transfer.size() < _transferSize) {
+                        auto& lane = _lanes[pick()];
+                        const auto& message = lane.messages.front();
+                        const auto size = std::min(message.size() - lane.offset, _transferSize - transfer.size());
+                        if (lane.priority == 0) {
+                            lane.deficit -= static_cast<int64_t>(size);
+                        }
+                        transfer.insert(
+                            transfer.end(),
+                            std::next(message.begin(), static_cast<std::ptrdiff_t>(lane.offset)),
+                            std::next(message.begin(), static_cast<std::ptrdiff_t>(lane.offset + size))
+                        );
+                        lane.offset += size;
+                        _queuedBytes -= size;
+                        lane.queuedBytes -= size;
+                        lane.sentBytes += size;
+                        if (lane.offset == message.size()) {
+                            lane.messages.pop_front();
+                            lane.offset = 0;
+                            ++lane.sentMessages;
+                        }
+                    }
+                    _writing = true;
+                    lock.unlock();
+                    try {
+                        _chip.write(transfer);
+                    } catch (...) {
+                        lock.lock();
+                        _exception = std::current_exception();
+                        _writing = false;
+                        _idleCondition.notify_all();
+                        break;
+                    }
+                    lock.lock();
+                    _writing = false;
+                    if (_queuedBytes == 0) {
+                        _idleCondition.notify_all();
+                    }
+                }
+            }
+
+            Chip& _chip;
+            const std::size_t _transferSize;
+            const std::size_t _quantum;
+            bool _running;
+            bool _writing;
+            std::size_t _queuedBytes;
+            std::size_t _cursor;
+            std::vector<Lane> _lanes;
+            std::vector<std::size_t> _prioritizedLanes;
+            std::vector<std::size_t> _weightedLanes;
+            std::unordered_map<std::string, std::size_t> _indexByName;
+            std::mutex _mutex;
+            std::condition_variable _condition;
+            std::condition_variable _idleCondition;
+            std::exception_ptr _exception;
+            std::thread _thread;
+    };
+
+    /// Scheduling configures the CPU affinity and the priority of a library thread.
+    struct Scheduling {
+        /// cpu is the index of the CPU the thread is pinned to, or -1 to let the operating system choose (default).
+        /// CPU affinity is only supported under Linux.
+        int32_t cpu;
+
+        /// priority is the thread's SCHED_FIFO real-time priority (1 to 99), or 0 to keep the default policy (default).
+        /// Real-time priorities require the CAP_SYS_NICE capability (or root) under Linux.
+        int32_t priority;
+
+        /// lockMemory locks the process' current and future pages in memory (mlockall), so that the buffers are never paged out.
+        bool lockMemory;
+
+        Scheduling() :
+            cpu(-1),
+            priority(0),
+            lockMemory(false)
+        {
+        }
+
+        /// apply configures the given thread, and throws if a setting cannot be applied.
+        void apply(std::thread& thread) const {
+            if (cpu >= 0) {
+                #ifdef __linux__
+                    cpu_set_t cpus;
+                    CPU_ZERO(&cpus);
+                    CPU_SET(cpu, &cpus);
+                    const auto error = pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpus);
+                    if (error != 0) {
+                        throw std::runtime_error(
+                            "pinning the thread to the CPU " + std::to_string(cpu) + " failed with the error " + std::strerror(error)
+                        );
+                    }
+                #else
+                    throw std::runtime_error("CPU affinity is not supported on this platform");
+                #endif
+            }
+            if (priority > 0) {
+                auto parameters = sched_param{};
+                parameters.sched_priority = priority;
+                const auto error = pthread_setschedparam(thread.native_handle(), SCHED_FIFO, &parameters);
+                if (error != 0) {
+                    throw std::runtime_error(
+                        "setting the real-time priority " + std::to_string(priority) + " failed with the error " + std::strerror(error)
+                    );
+                }
+            }
+        }
+
+        /// lock locks the process' memory if lockMemory is true.
+        void lock() const {
+            if (lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+                throw std::runtime_error(std::string("locking the memory failed with the error ") + std::strerror(errno));
+            }
+        }
+    };
+
+    /// StreamOptions configures a stream.
+    struct StreamOptions {
+        /// transfers is the number of read transfers kept in flight.
+        std::size_t transfers;
+
+        /// chunks is the number of chunks in the pool shared by the event thread and the consumer.
+        /// It must be larger than transfers.
+        std::size_t chunks;
+
+        /// transferSize is the size of the read transfers in bytes (status bytes included), or 0 to use the chip's transfer size (default).
+        /// Small transfers reduce the time spent by the event thread on each completion.
+        /// In adaptive mode, transferSize is the maximum transfer size.
+        std::size_t transferSize;
+
+        /// adaptive resizes the read transfers according to the arrival rate, between minimumTransferSize and transferSize.
+        /// The arrival rate is estimated with an exponentially weighted moving average (EWMA) of the completions' rates,
+        /// and each transfer is submitted with the number of bytes expected during fillDuration.
+        bool adaptive;
+
+        /// minimumTransferSize is the smallest transfer size in adaptive mode, or 0 to use the chip's packet size (default).
+        std::size_t minimumTransferSize;
+
+        /// fillDuration is the time that an adaptive transfer should take to fill up at the estimated arrival rate.
+        std::chrono::microseconds fillDuration;
+
+        /// smoothing is the weight of the latest completion in the arrival rate estimate (between 0 and 1).
+        double smoothing;
+
+        /// idleTimeout is the longest time next waits for bytes before returning an empty chunk, or 0 to wait indefinitely (default).
+        std::chrono::milliseconds idleTimeout;
+
+        /// busyPoll makes the event thread poll for completions without sleeping, instead of waiting for the kernel to wake it up,
+        /// and makes next spin until a chunk is ready instead of waiting for the event thread to wake it up.
+        /// This saves the scheduler's wake-up latencies at the cost of two CPU cores, and should be used with pinned threads (see scheduling.cpu).
+        bool busyPoll;
+
+        /// scheduling configures the event thread.
+        Scheduling scheduling;
+
+        StreamOptions() :
+            transfers(8),
+            chunks(64),
+            transferSize(0),
+            adaptive(false),
+            minimumTransferSize(0),
+            fillDuration(1000),
+            smoothing(0.1),
+            idleTimeout(0),
+            busyPoll(false)
+        {
+        }
+    };
+
+    /// StreamChunk is a view on the bytes received by a read transfer.
+    struct StreamChunk {
+        /// begin points to the chunk's first byte.
+        const uint8_t* begin;
+
+        /// end points to the byte following the chunk's last byte.
+        const uint8_t* end;
+
+        /// status holds the transfer's status bytes, sequence number and completion timestamps.
+        ReadStatus status;
+    };
+
+    /// Stream keeps read transfers in flight from a dedicated event thread, and hands the received chunks to a consumer.
+    /// The chunks are stored in a pool allocated and pre-faulted when the stream is created, and the chip pools the read transfers,
+    /// hence the hot path does not allocate memory.
+    /// If the consumer does not keep up, the event thread stops submitting reads until chunks are released, and the chip's buffer fills up.
+    /// The chip's asynchronous functions (submitRead, submitWrite, handleEvents) must not be called by other threads while the stream is running.
+    class Stream {
+        public:
+            Stream(Chip& chip, StreamOptions options = StreamOptions()) :
+                _chip(chip),
+                _options(options),
+                _running(true),
+                _chunks(options.chunks),
+                _readyChunks(options.chunks, nullptr),
+                _readyBegin(0),
+                _readyCount(0),
+                _current(nullptr),
+                _inFlight(0),
+                _maximumTransferSize(options.transferSize == 0 ? chip.transferSize() : options.transferSize),
+                _minimumTransferSize(options.minimumTransferSize == 0 ? chip.packetSize() : options.minimumTransferSize),
+                _transferSize(options.adaptive ? _minimumTransferSize : _maximumTransferSize),
+                _rate(0),
+                _emptyCompletions(0),
+                _idle{{0}}
+            {
+                if (options.transfers == 0 || options.chunks <= options.transfers) {
+                    throw std::runtime_error("the number of chunks must be larger than the number of transfers, which must be larger than zero");
+                }
+                if (options.adaptive && (_minimumTransferSize > _maximumTransferSize || options.smoothing <= 0 || options.smoothing > 1)) {
+                    throw std::runtime_error("the minimum transfer size must not exceed the transfer size, and the smoothing must be in ]0, 1]");
+                }
+                options.scheduling.lock();
+                _freeChunks.reserve(options.chunks);
+                for (auto& chunk : _chunks) {
+                    chunk.bytes.resize(chip.transferSize());
+                    chunk.bytes.clear();
+                    _freeChunks.push_back(&chunk);
+                }
+                _thread = std::thread(&Stream::run, this);
+                try {
+                    options.scheduling.apply(_thread);
+                } catch (...) {
+                    stop();
+                    throw;
+                }
+            }
+            Stream(const Stream&) = delete;
+            Stream(Stream&&) = delete;
+            Stream& operator=(const Stream&) = delete;
+            Stream& operator=(Stream&&) = delete;
+            virtual ~Stream() {
+                try {
+                    stop();
+                } catch (...) {
+                }
+            }
+
+            /// next releases the previous chunk, and waits for the next one.
+            /// The returned chunk is valid until the next call to next.
+            /// Transfers which only carry status bytes (the chip sends them every latency timer tick when it has nothing to send) are not returned.
+            /// If no bytes are received during the idle timeout, next returns an empty chunk whose begin is not nullptr
+            /// (it points to a dedicated buffer, never to a chunk of the pool).
+            /// In busy-poll mode, next spins on the number of ready chunks instead of sleeping.
+            /// Once the stream is stopped and the chunks received before have been returned, next returns a chunk whose begin is nullptr,
+            /// or rethrows the exception which interrupted the event thread.
+            virtual StreamChunk next() {
+                std::unique_lock<std::mutex> lock(_mutex);
+                if (_current != nullptr) {
+                    _freeChunks.push_back(_current);
+                    _current = nullptr;
+                }
+                const auto ready = [this]() {
+                    return _readyCount.load(std::memory_order_acquire) > 0 || !_running.load(std::memory_order_acquire);
+                };
+                if (_options.busyPoll) {
+
+                    // the mutex is released while spinning, so that the event thread can hand over chunks
+                    // the thread yields regularly, so that a sibling hyperthread running the event thread is not starved
+                    lock.unlock();
+                    const auto begin = std::chrono::steady_clock::now();
+                    for (std::size_t spins = 1; !ready(); ++spins) {
+                        if (spins % 64 == 0) {
+                            std::this_thread::yield();
+                        }
+                        if (_options.idleTimeout.count() > 0 && std::chrono::steady_clock::now() - begin >= _options.idleTimeout) {
+                            return StreamChunk{_idle.data(), _idle.data(), ReadStatus{}};
+                        }
+                    }
+                    lock.lock();
+                } else if (_options.idleTimeout.count() > 0) {
+                    if (!_readyCondition.wait_for(lock, _options.idleTimeout, ready)) {
+                        return StreamChunk{_idle.data(), _idle.data(), ReadStatus{}};
+                    }
+                } else {
+                    _readyCondition.wait(lock, ready);
+                }
+                if (_readyCount.load(std::memory_order_relaxed) == 0) {
+                    if (_exception) {
+                        std::rethrow_exception(_exception);
+                    }
+                    return StreamChunk{nullptr, nullptr, ReadStatus{}};
+                }
+                _current = _readyChunks[_readyBegin];
+                _readyBegin = (_readyBegin + 1) % _readyChunks.size();
+                _readyCount.fetch_sub(1, std::memory_order_relaxed);
+                return StreamChunk{_current->bytes.data(), _current->bytes.data() + _current->bytes.size(), _current->status};
+            }
+
+            /// emptyCompletions returns the number of transfers which only carried status bytes, and were not returned by next.
+            /// This function can be called from any thread.
+            virtual uint64_t emptyCompletions() const {
+                return _emptyCompletions.load(std::memory_order_relaxed);
+            }
+
+            /// transferSize returns the size of the next read transfers, which changes with the arrival rate in adaptive mode.
+            /// This function can be called from any thread.
+            virtual std::size_t transferSize() const {
+                return _transferSize.load(std::memory_order_relaxed);
+            }
+
+            /// stop waits for the transfers in flight and terminates the event thread.
+            /// It rethrows the exception which interrupted the event thread, if any.
+            virtual void stop() {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _running.store(false, std::memory_order_release);
+                }
+                _readyCondition.notify_all();
+                if (_thread.joinable()) {
+                    _thread.join();
+                }
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_exception) {
+                    const auto exception = _exception;
+                    _exception = nullptr;
+                    std::rethrow_exception(exception);
+                }
+            }
+
+        protected:
+            /// Chunk holds the bytes of a read transfer.
+            struct Chunk {
+                std::vector<uint8_t> bytes;
+                ReadStatus status;
+            };
+
+            /// fail stores the current exception and stops the stream.
+            void fail() {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_exception) {
+                        _exception = std::current_exception();
+                    }
+                    _running.store(false, std::memory_order_release);
+                }
+                _readyCondition.notify_all();
+            }
+
+            /// run keeps read transfers in flight and handles their completions, until the stream is stopped.
+            void run() {
+                try {
+                    while (_running.load(std::memory_order_acquire)) {
+                        submitReads();
+                        _chip.handleEvents(_options.busyPoll ? 0 : 10);
+                    }
+                } catch (...) {
+                    fail();
+                }
+
+                // the handlers reference the stream, hence the transfers in flight must complete before the thread returns
+                try {
+                    while (_inFlight > 0) {
+                        _chip.handleEvents(10);
+                    }
+                } catch (...) {
+                    fail();
+                }
+            }
+
+            /// submitReads submits read transfers until the target is reached or the pool is empty.
+            void submitReads() {
+                while (_inFlight < _options.transfers) {
+                    Chunk* chunk;
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        if (_freeChunks.empty()) {
+                            break;
+                        }
+                        chunk = _freeChunks.back();
+                        _freeChunks.pop_back();
+                    }
+                    ++_inFlight;
+                    try {
+                        _chip.submitRead([this, chunk](libusb_transfer_status status, const std::vector<uint8_t>& bytes, ReadStatus readStatus) {
+                            onRead(chunk, status, bytes, readStatus);
+                        }, _transferSize.load(std::memory_order_relaxed));
+                    } catch (...) {
+                        --_inFlight;
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        _freeChunks.push_back(chunk);
+                        throw;
+                    }
+                }
+            }
+
+            /// onRead moves a completed transfer's bytes to its chunk, and hands the chunk to the consumer.
+            /// It is called by handleEvents, and must not throw.
+            void onRead(Chunk* chunk, libusb_transfer_status status, const std::vector<uint8_t>& bytes, ReadStatus readStatus) {
+                --_inFlight;
+                if (status != LIBUSB_TRANSFER_COMPLETED && status != LIBUSB_TRANSFER_TIMED_OUT) {
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        _freeChunks.push_back(chunk);
+                    }
+                    try {
+                        throw std::runtime_error("reading bytes failed with the transfer status " + std::to_string(static_cast<int32_t>(status)));
+                    } catch (...) {
+                        fail();
+                    }
+                    return;
+                }
+                if (_options.adaptive) {
+                    adapt(bytes.size());
+                }
+
+                // status-only transfers are recycled without waking up the consumer, unless they report an error
+                if (
+                    bytes.empty()
+                    && !readStatus.overrun()
+                    && !readStatus.parityError()
+                    && !readStatus.framingError()
+                    && !readStatus.breakInterrupt()
+                ) {
+                    _emptyCompletions.fetch_add(1, std::memory_order_relaxed);
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _freeChunks.push_back(chunk);
+                    return;
+                }
+                chunk->bytes.assign(bytes.begin(), bytes.end());
+                chunk->status = readStatus;
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _readyChunks[(_readyBegin + _readyCount.load(std::memory_order_relaxed)) % _readyChunks.size()] = chunk;
+                    _readyCount.fetch_add(1, std::memory_order_release);
+                }
+
+                // in busy-poll mode, the consumer spins on the ready count and does not need to be woken up
+                if (!_options.busyPoll) {
+                    _readyCondition.notify_one();
+                }
+            }
+
+            /// adapt updates the arrival rate estimate with a completion, and resizes the next transfers accordingly.
+            void adapt(std::size_t size) {
+                const auto now = std::chrono::steady_clock::now();
+                if (_previousCompletion != std::chrono::steady_clock::time_point()) {
+                    const auto elapsed = std::chrono::duration<double, std::micro>(now - _previousCompletion).count();
+                    if (elapsed > 0) {
+                        _rate += _options.smoothing * (static_cast<double>(size) / elapsed - _rate);
+                    }
+                }
+                _previousCompletion = now;
+
+                // the status bytes take two bytes per packet
+                const auto packetSize = _chip.packetSize();
+                const auto payloadSize = packetSize - HighSpeed::statusSize();
+                const auto expectedPackets = static_cast<std::size_t>(_rate * static_cast<double>(_options.fillDuration.count()) / payloadSize) + 1;
+                _transferSize.store(
+                    std::max(_minimumTransferSize, std::min(expectedPackets * packetSize, _maximumTransferSize)),
+                    std::memory_order_relaxed
+                );
+            }
+
+            Chip& _chip;
+            const StreamOptions _options;
+            std::atomic<bool> _running;
+            std::vector<Chunk> _chunks;
+            std::vector<Chunk*> _freeChunks;
+            std::vector<Chunk*> _readyChunks;
+            std::size_t _readyBegin;
+            std::atomic<std::size_t> _readyCount;
+            Chunk* _current;
+            std::size_t _inFlight;
+            const std::size_t _maximumTransferSize;
+            const std::size_t _minimumTransferSize;
+            std::atomic<std::size_t> _transferSize;
+            double _rate;
+            std::chrono::steady_clock::time_point _previousCompletion;
+            std::atomic<uint64_t> _emptyCompletions;
+            std::array<uint8_t, 1> _idle;
+            std::mutex _mutex;
+            std::condition_variable _readyCondition;
+            std::exception_ptr _exception;
+            std::thread _thread;
     };
 
     /// DriverGuard unloads the default OS X driver for ftdi chips when constructed, and reloads it when destructed.
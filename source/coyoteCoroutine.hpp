@@ -0,0 +1,145 @@
+#pragma once
+
+#include "coyote.hpp"
+
+#if __cplusplus < 202002L
+#error "coyoteCoroutine.hpp requires C++20"
+#endif
+
+#include <coroutine>
+#include <span>
+
+/// coyote extends the chip with awaitable asynchronous transfers.
+/// This header is optional, and requires C++20. The core library (coyote.hpp) requires C++11 only.
+namespace coyote {
+
+    /// Executor resumes a coroutine suspended on a transfer.
+    /// An empty executor resumes the coroutine inline, in the thread which calls handleEvents (or processEvents).
+    using Executor = std::function<void(std::coroutine_handle<>)>;
+
+    /// TransferAwaitable holds the state shared by the read and write awaitables.
+    class TransferAwaitable {
+        public:
+            TransferAwaitable(Executor executor) :
+                _executor(std::move(executor)),
+                _transferStatus(LIBUSB_TRANSFER_ERROR)
+            {
+            }
+            TransferAwaitable(const TransferAwaitable&) = delete;
+            TransferAwaitable(TransferAwaitable&&) = delete;
+            TransferAwaitable& operator=(const TransferAwaitable&) = delete;
+            TransferAwaitable& operator=(TransferAwaitable&&) = delete;
+            virtual ~TransferAwaitable() {}
+
+            /// await_ready returns false, since the transfer is submitted when the coroutine is suspended.
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+        protected:
+
+            /// resume resumes the coroutine with the executor, or inline if the executor is empty.
+            /// The awaitable may be destroyed by the resumed coroutine, hence resume must be the handler's last statement.
+            void resume(std::coroutine_handle<> handle) {
+                if (_executor) {
+                    _executor(handle);
+                } else {
+                    handle.resume();
+                }
+            }
+
+            /// checkTransferStatus throws an exception if the transfer did not complete.
+            void checkTransferStatus(std::string message) const {
+                if (_transferStatus != LIBUSB_TRANSFER_COMPLETED) {
+                    throw std::runtime_error(message + " failed with the transfer status " + std::to_string(static_cast<int32_t>(_transferStatus)));
+                }
+            }
+
+            Executor _executor;
+            libusb_transfer_status _transferStatus;
+    };
+
+    /// ReadAwaitable suspends a coroutine until an asynchronous read transfer completes.
+    /// The received bytes are copied to the buffer, and co_await returns the transfer's status bytes.
+    template <typename Configuration>
+    class ReadAwaitable : public TransferAwaitable {
+        public:
+            ReadAwaitable(BasicChip<Configuration>& chip, std::vector<uint8_t>& buffer, Executor executor) :
+                TransferAwaitable(std::move(executor)),
+                _chip(chip),
+                _buffer(buffer),
+                _status(ReadStatus{})
+            {
+            }
+
+            /// await_suspend submits the read transfer.
+            void await_suspend(std::coroutine_handle<> handle) {
+                _chip.submitRead([this, handle](libusb_transfer_status transferStatus, const std::vector<uint8_t>& bytes, ReadStatus status) {
+                    _transferStatus = transferStatus;
+                    _status = status;
+                    _buffer.assign(bytes.begin(), bytes.end());
+                    resume(handle);
+                });
+            }
+
+            /// await_resume throws an exception if the transfer failed, and returns the transfer's status bytes otherwise.
+            ReadStatus await_resume() const {
+                checkTransferStatus("reading bytes");
+                return _status;
+            }
+
+        protected:
+            BasicChip<Configuration>& _chip;
+            std::vector<uint8_t>& _buffer;
+            ReadStatus _status;
+    };
+
+    /// WriteAwaitable suspends a coroutine until an asynchronous write transfer completes.
+    /// co_await returns the number of bytes sent.
+    template <typename Configuration>
+    class WriteAwaitable : public TransferAwaitable {
+        public:
+            WriteAwaitable(BasicChip<Configuration>& chip, std::span<const uint8_t> bytes, Executor executor) :
+                TransferAwaitable(std::move(executor)),
+                _chip(chip),
+                _bytes(bytes),
+                _sent(0)
+            {
+            }
+
+            /// await_suspend submits the write transfer.
+            void await_suspend(std::coroutine_handle<> handle) {
+                _chip.submitWrite(_bytes.data(), _bytes.size(), [this, handle](libusb_transfer_status transferStatus, std::size_t sent) {
+                    _transferStatus = transferStatus;
+                    _sent = sent;
+                    resume(handle);
+                });
+            }
+
+            /// await_resume throws an exception if the transfer failed, and returns the number of bytes sent otherwise.
+            std::size_t await_resume() const {
+                checkTransferStatus("writing bytes");
+                return _sent;
+            }
+
+        protected:
+            BasicChip<Configuration>& _chip;
+            std::span<const uint8_t> _bytes;
+            std::size_t _sent;
+    };
+
+    /// asyncRead returns an awaitable which receives bytes from the chip into buffer.
+    /// The coroutine is resumed by the thread which calls the chip's handleEvents (or processEvents), or by the executor.
+    template <typename Configuration>
+    ReadAwaitable<Configuration> asyncRead(BasicChip<Configuration>& chip, std::vector<uint8_t>& buffer, Executor executor = Executor()) {
+        return ReadAwaitable<Configuration>(chip, buffer, std::move(executor));
+    }
+
+    /// asyncWrite returns an awaitable which sends bytes to the chip with a single asynchronous transfer.
+    /// The bytes are not copied, and must remain valid until the coroutine is resumed.
+    /// Unlike write, asyncWrite bypasses the write buffer: the bytes are sent immediately, and may overtake buffered bytes.
+    template <typename Configuration>
+    WriteAwaitable<Configuration> asyncWrite(BasicChip<Configuration>& chip, std::span<const uint8_t> bytes, Executor executor = Executor()) {
+        return WriteAwaitable<Configuration>(chip, bytes, std::move(executor));
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "../source/coyote.hpp"
+
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/// TemporaryFile reserves a unique path in the temporary directory, and removes the file when destroyed.
+class TemporaryFile {
+    public:
+        TemporaryFile() {
+            const auto directory = std::getenv("TMPDIR");
+            auto path = std::string(directory != nullptr && directory[0] != '\0' ? directory : "/tmp") + "/coyoteTest-XXXXXX";
+            const auto file = mkstemp(&path[0]);
+            if (file < 0) {
+                throw std::runtime_error("creating a temporary file failed");
+            }
+            ::close(file);
+            _path = path;
+        }
+        TemporaryFile(const TemporaryFile&) = delete;
+        TemporaryFile(TemporaryFile&&) = delete;
+        TemporaryFile& operator=(const TemporaryFile&) = delete;
+        TemporaryFile& operator=(TemporaryFile&&) = delete;
+        virtual ~TemporaryFile() {
+            std::remove(_path.c_str());
+        }
+
+        /// path returns the file's path.
+        const std::string& path() const {
+            return _path;
+        }
+
+    protected:
+        std::string _path;
+};
+
+/// TestRecord is a record written to a capture file by writeCapture.
+struct TestRecord {
+    /// timestamp is the reception time in nanoseconds since the beginning of the recording.
+    uint64_t timestamp;
+
+    /// payload holds the record's bytes.
+    std::vector<uint8_t> payload;
+};
+
+/// writeCapture writes a capture file (see coyote::Recorder) with the given records.
+inline void writeCapture(const std::string& path, const std::vector<TestRecord>& records) {
+    auto capture = std::vector<uint8_t>(coyote::Recorder::signature().begin(), coyote::Recorder::signature().end());
+    for (const auto& record : records) {
+        auto header = std::array<uint8_t, 16>();
+        for (std::size_t index = 0; index < 8; ++index) {
+            header[index] = static_cast<uint8_t>((record.timestamp >> (8 * index)) & 0xff);
+        }
+        for (std::size_t index = 0; index < 4; ++index) {
+            header[8 + index] = static_cast<uint8_t>((record.payload.size() >> (8 * index)) & 0xff);
+        }
+        capture.insert(capture.end(), header.begin(), header.end());
+        capture.insert(capture.end(), record.payload.begin(), record.payload.end());
+    }
+    auto file = std::ofstream(path, std::ofstream::binary);
+    file.write(reinterpret_cast<const char*>(capture.data()), capture.size());
+}
@@ -0,0 +1,80 @@
+#include "../catch.hpp"
+
+#include "../../source/coyoteCoroutine.hpp"
+#include "../captureFile.hpp"
+
+/// Task is a minimal coroutine type, started eagerly and destroyed when it returns.
+struct Task {
+    struct promise_type {
+        Task get_return_object() {
+            return Task{};
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+/// writeAndRead sends a message to the chip, then reads until the chip is finished.
+Task writeAndRead(coyote::ReplayChip& chip, std::size_t& sent, std::vector<uint8_t>& bytes, bool& done) {
+    const auto message = std::vector<uint8_t>(5, 1);
+    sent = co_await coyote::asyncWrite(chip, message);
+    auto buffer = std::vector<uint8_t>();
+    while (!chip.finished()) {
+        co_await coyote::asyncRead(chip, buffer);
+        bytes.insert(bytes.end(), buffer.begin(), buffer.end());
+    }
+    done = true;
+}
+
+/// writeWithExecutor sends a message to the chip, and is resumed by the executor.
+Task writeWithExecutor(coyote::ReplayChip& chip, std::size_t& sent, coyote::Executor executor) {
+    const auto message = std::vector<uint8_t>(3, 1);
+    sent = co_await coyote::asyncWrite(chip, message, std::move(executor));
+}
+
+TEST_CASE("Await the transfers of a replay chip", "[ReplayChip]") {
+    const TemporaryFile replay;
+    auto records = std::vector<TestRecord>();
+    for (uint8_t index = 0; index < 10; ++index) {
+        records.push_back(TestRecord{0, {index, index}});
+    }
+    writeCapture(replay.path(), records);
+    coyote::ReplayChip chip(replay.path());
+    auto bytes = std::vector<uint8_t>();
+    auto sent = static_cast<std::size_t>(0);
+    auto done = false;
+    writeAndRead(chip, sent, bytes, done);
+    while (!done) {
+        chip.processEvents();
+    }
+    REQUIRE(sent == 5);
+    REQUIRE(bytes.size() == 20);
+    for (std::size_t index = 0; index < bytes.size(); ++index) {
+        REQUIRE(bytes[index] == index / 2);
+    }
+}
+
+TEST_CASE("Resume the coroutines awaiting a replay chip with an executor", "[ReplayChip]") {
+    const TemporaryFile replay;
+    writeCapture(replay.path(), {});
+    coyote::ReplayChip chip(replay.path());
+    auto handles = std::vector<std::coroutine_handle<>>();
+    const auto executor = [&](std::coroutine_handle<> handle) {
+        handles.push_back(handle);
+    };
+    auto sent = static_cast<std::size_t>(0);
+    writeWithExecutor(chip, sent, executor);
+    chip.processEvents();
+    REQUIRE(handles.size() == 1);
+    REQUIRE(sent == 0);
+    handles.front().resume();
+    REQUIRE(sent == 3);
+}
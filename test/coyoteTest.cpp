@@ -1,11 +1,23 @@
 #include "catch.hpp"
 
 #include "../source/coyote.hpp"
+#include "captureFile.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <ctime>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <thread>
 #include <mutex>
+#include <future>
+#include <numeric>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 TEST_CASE("Connect to the first available chip", "[DriverGuard, Chip]") {
     const auto driverGuard = coyote::DriverGuard();
@@ -17,6 +29,16 @@ TEST_CASE("Connect to the chip with the given id", "[DriverGuard, Chip]") {
     REQUIRE_NOTHROW(coyote::Chip("writer"));
 }
 
+TEST_CASE("Connect to the chip with the given id and check its link speed", "[DriverGuard, Chip]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("writer");
+    REQUIRE((chip.speed() == LIBUSB_SPEED_HIGH || chip.speed() == LIBUSB_SPEED_FULL));
+    REQUIRE(chip.packetSize() == (chip.speed() == LIBUSB_SPEED_HIGH ? 512 : 64));
+    if (chip.speed() != LIBUSB_SPEED_HIGH) {
+        WARN("the chip is connected to a full-speed port");
+    }
+}
+
 TEST_CASE("Connect to the chip with the given id and monitor the writing performance", "[DriverGuard, Chip]") {
     const auto driverGuard = coyote::DriverGuard();
     auto chip = coyote::Chip("writer");
@@ -39,3 +61,1056 @@ TEST_CASE("Connect to the chip with the given id and monitor its reading perform
     const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - begin).count();
     std::cout << "Reading bitrate: " << readBytes / static_cast<double>(duration) << " MB/s" << std::endl;
 }
+
+TEST_CASE("Connect to the chip with the given id and monitor the round-trip latency", "[DriverGuard, Chip]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("loopback");
+    const auto iterations = static_cast<std::size_t>(1000);
+    for (auto latencyTimer : std::vector<uint8_t>({1, 2, 4, 16})) {
+        chip.setLatencyTimer(latencyTimer);
+        for (auto size : std::vector<std::size_t>({4, 64, 510, 4096})) {
+            for (auto flush : std::vector<bool>({true, false})) {
+                auto latencies = std::vector<double>();
+                latencies.reserve(iterations);
+                auto packet = std::vector<uint8_t>(size);
+                for (std::size_t iteration = 0; iteration < iterations; ++iteration) {
+
+                    // tag the packet with the iteration index
+                    for (std::size_t index = 0; index < 4; ++index) {
+                        packet[index] = static_cast<uint8_t>((iteration >> (8 * index)) & 0xff);
+                    }
+                    auto echo = std::vector<uint8_t>();
+                    echo.reserve(size);
+                    const auto begin = std::chrono::high_resolution_clock::now();
+                    if (flush) {
+                        chip.write(packet);
+                    } else {
+                        chip.write(packet, false);
+                        chip.write(std::vector<uint8_t>());
+                    }
+                    while (echo.size() < size) {
+                        const auto bytes = chip.read();
+                        echo.insert(echo.end(), bytes.begin(), bytes.end());
+                    }
+                    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::high_resolution_clock::now() - begin
+                    ).count() / 1e3);
+                    REQUIRE(echo.size() == size);
+                    REQUIRE(std::equal(packet.begin(), std::next(packet.begin(), 4), echo.begin()));
+                }
+
+                // build a log-linear histogram
+                std::sort(latencies.begin(), latencies.end());
+                auto histogram = std::array<std::size_t, 128>{};
+                for (auto latency : latencies) {
+                    ++histogram[coyote::Statistics::bucket(static_cast<uint64_t>(latency))];
+                }
+                std::cout
+                    << "Round-trip latency (latency timer: " << static_cast<uint32_t>(latencyTimer)
+                    << " ms, size: " << size
+                    << " bytes, flush: " << (flush ? "immediate" : "deferred") << ")\n"
+                    << "    p50: " << latencies[latencies.size() / 2] << " us"
+                    << ", p90: " << latencies[latencies.size() * 9 / 10] << " us"
+                    << ", p99: " << latencies[latencies.size() * 99 / 100] << " us"
+                    << ", p99.9: " << latencies[latencies.size() * 999 / 1000] << " us"
+                    << ", max: " << latencies.back() << " us\n";
+                for (std::size_t bucket = 0; bucket < histogram.size(); ++bucket) {
+                    if (histogram[bucket] > 0) {
+                        std::cout << "    >= " << coyote::Statistics::lowerBound(bucket) << " us: " << histogram[bucket] << "\n";
+                    }
+                }
+                std::cout.flush();
+            }
+        }
+    }
+}
+
+TEST_CASE("Connect to the chip with the given id and monitor the full-duplex throughput", "[DriverGuard, Chip]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("loopback");
+    const auto writersCount = static_cast<std::size_t>(4);
+    const auto target = writersCount * 640 * 4096;
+    auto writers = std::vector<std::thread>();
+    const auto begin = std::chrono::high_resolution_clock::now();
+    for (std::size_t writer = 0; writer < writersCount; ++writer) {
+        writers.emplace_back([&chip, writersCount, target]() {
+            const auto bytes = std::vector<uint8_t>(4096);
+            for (std::size_t sent = 0; sent < target / writersCount; sent += bytes.size()) {
+                chip.write(bytes, false);
+            }
+            chip.write(std::vector<uint8_t>());
+        });
+    }
+    auto readBytes = static_cast<std::size_t>(0);
+    while (readBytes < target) {
+        readBytes += chip.read().size();
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - begin
+    ).count();
+    REQUIRE(readBytes == target);
+    std::cout << "full-duplex throughput: " << static_cast<double>(target) / duration << " MB/s in each direction" << std::endl;
+}
+
+TEST_CASE("Connect to the chip with the given id and purge its buffers", "[DriverGuard, Chip]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("loopback");
+    chip.write(std::vector<uint8_t>(4096, 0));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE_NOTHROW(chip.purgeTx());
+    REQUIRE_NOTHROW(chip.purgeRx());
+    chip.write(std::vector<uint8_t>(4, 1));
+    auto echo = std::vector<uint8_t>();
+    while (echo.size() < 4) {
+        const auto bytes = chip.read();
+        echo.insert(echo.end(), bytes.begin(), bytes.end());
+    }
+    REQUIRE(echo == std::vector<uint8_t>(4, 1));
+}
+
+TEST_CASE("Connect to the chip with the given id and monitor the recovery duration", "[DriverGuard, Chip]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("loopback");
+    const auto begin = std::chrono::high_resolution_clock::now();
+    chip.recover();
+    const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - begin
+    ).count();
+    chip.write(std::vector<uint8_t>(4, 1));
+    auto echo = std::vector<uint8_t>();
+    while (echo.size() < 4) {
+        const auto bytes = chip.read();
+        echo.insert(echo.end(), bytes.begin(), bytes.end());
+    }
+    REQUIRE(echo == std::vector<uint8_t>(4, 1));
+    std::cout << "recovery duration: " << duration << " us" << std::endl;
+}
+
+#ifdef __linux__
+TEST_CASE("Connect to the chip with the given id and compare the libusb and usbfs transports", "[DriverGuard, Chip, UsbfsChip]") {
+    const auto driverGuard = coyote::DriverGuard();
+    const auto iterations = static_cast<std::size_t>(1000);
+    const auto target = static_cast<std::size_t>(10e6);
+    const auto benchmark = [&](coyote::Chip& chip, const std::string& name) {
+        chip.setLatencyTimer(1);
+        auto latencies = std::vector<double>();
+        latencies.reserve(iterations);
+        const auto packet = std::vector<uint8_t>(64, 1);
+        for (std::size_t iteration = 0; iteration < iterations; ++iteration) {
+            auto echo = static_cast<std::size_t>(0);
+            const auto begin = std::chrono::high_resolution_clock::now();
+            chip.write(packet);
+            while (echo < packet.size()) {
+                echo += chip.read().size();
+            }
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - begin
+            ).count() / 1e3);
+            REQUIRE(echo == packet.size());
+        }
+        std::sort(latencies.begin(), latencies.end());
+        const auto bytes = std::vector<uint8_t>(target);
+        const auto begin = std::chrono::high_resolution_clock::now();
+        auto writer = std::thread([&]() {
+            chip.write(bytes);
+        });
+        auto readBytes = static_cast<std::size_t>(0);
+        while (readBytes < target) {
+            readBytes += chip.read().size();
+        }
+        writer.join();
+        const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() - begin
+        ).count();
+        REQUIRE(readBytes == target);
+        std::cout
+            << name
+            << ": median round-trip latency " << latencies[latencies.size() / 2] << " us"
+            << ", 99th percentile " << latencies[latencies.size() * 99 / 100] << " us"
+            << ", loopback throughput " << static_cast<double>(target) / duration << " MB/s"
+            << std::endl;
+    };
+    {
+        auto chip = coyote::Chip("loopback");
+        benchmark(chip, "libusb");
+    }
+    {
+        coyote::UsbfsChip chip("loopback");
+        benchmark(chip, "usbfs");
+    }
+}
+#endif
+
+#ifdef __linux__
+TEST_CASE("Connect to the chip with the given id and drive its transfers with epoll", "[DriverGuard, Chip]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("loopback");
+    const auto epoll = epoll_create1(0);
+    REQUIRE(epoll >= 0);
+    const auto watch = [epoll](libusb_pollfd pollfd) {
+        auto event = epoll_event{};
+        event.events = static_cast<uint32_t>(pollfd.events);
+        event.data.fd = pollfd.fd;
+        REQUIRE(epoll_ctl(epoll, EPOLL_CTL_ADD, pollfd.fd, &event) == 0);
+    };
+    for (const auto& pollfd : chip.pollfds()) {
+        watch(pollfd);
+    }
+    chip.setPollfdNotifiers(watch, [epoll](int32_t fd) {
+        REQUIRE(epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr) == 0);
+    });
+    const auto bytes = std::vector<uint8_t>(1 << 20, 1);
+    auto written = false;
+    auto echo = static_cast<std::size_t>(0);
+    std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, coyote::ReadStatus)> onRead;
+    onRead = [&](libusb_transfer_status status, const std::vector<uint8_t>& readBytes, coyote::ReadStatus) {
+        REQUIRE(status == LIBUSB_TRANSFER_COMPLETED);
+        echo += readBytes.size();
+        if (echo < bytes.size()) {
+            chip.submitRead(onRead);
+        }
+    };
+    for (std::size_t index = 0; index < 4; ++index) {
+        chip.submitRead(onRead);
+    }
+    chip.submitWrite(bytes.data(), bytes.size(), [&](libusb_transfer_status status, std::size_t sent) {
+        REQUIRE(status == LIBUSB_TRANSFER_COMPLETED);
+        REQUIRE(sent == bytes.size());
+        written = true;
+    });
+    const auto begin = std::chrono::high_resolution_clock::now();
+    while (!written || echo < bytes.size()) {
+        auto events = std::array<epoll_event, 8>();
+        epoll_wait(epoll, events.data(), static_cast<int>(events.size()), chip.nextTimeout());
+        chip.processEvents();
+    }
+    const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - begin
+    ).count();
+    chip.setPollfdNotifiers(nullptr, nullptr);
+    close(epoll);
+    REQUIRE(echo == bytes.size());
+    std::cout << "epoll loopback throughput: " << static_cast<double>(bytes.size()) / duration << " MB/s" << std::endl;
+}
+#endif
+
+TEST_CASE("Connect to the chip with the given id and monitor the stream latency", "[DriverGuard, Chip, Stream]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("loopback");
+    chip.setLatencyTimer(1);
+    auto options = coyote::StreamOptions();
+    options.scheduling.cpu = 0;
+    coyote::Stream stream(chip, options);
+    const auto packet = std::vector<uint8_t>(64, 1);
+    auto latencies = std::vector<double>();
+    for (std::size_t iteration = 0; iteration < 1000; ++iteration) {
+        auto echo = static_cast<std::size_t>(0);
+        const auto begin = std::chrono::high_resolution_clock::now();
+        chip.write(packet);
+        while (echo < packet.size()) {
+            const auto chunk = stream.next();
+            echo += static_cast<std::size_t>(chunk.end - chunk.begin);
+        }
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - begin
+        ).count() / 1e3);
+        REQUIRE(echo == packet.size());
+    }
+    stream.stop();
+    std::sort(latencies.begin(), latencies.end());
+    std::cout
+        << "stream: median round-trip latency " << latencies[latencies.size() / 2] << " us"
+        << ", 99th percentile " << latencies[latencies.size() * 99 / 100] << " us"
+        << std::endl;
+}
+
+TEST_CASE("Connect to the chip with the given id and compare the stream latency with and without busy polling", "[DriverGuard, Chip, Stream]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("loopback");
+    chip.setLatencyTimer(1);
+    const auto packet = std::vector<uint8_t>(64, 1);
+    for (auto busyPoll : {false, true}) {
+        auto options = coyote::StreamOptions();
+        options.transferSize = 4 * chip.packetSize();
+        options.busyPoll = busyPoll;
+        options.scheduling.cpu = 0;
+        coyote::Stream stream(chip, options);
+        auto latencies = std::vector<double>();
+        const auto cpuBegin = std::clock();
+        const auto begin = std::chrono::high_resolution_clock::now();
+        for (std::size_t iteration = 0; iteration < 10000; ++iteration) {
+            auto echo = static_cast<std::size_t>(0);
+            const auto writeBegin = std::chrono::high_resolution_clock::now();
+            chip.write(packet);
+            while (echo < packet.size()) {
+                const auto chunk = stream.next();
+                echo += static_cast<std::size_t>(chunk.end - chunk.begin);
+            }
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - writeBegin
+            ).count() / 1e3);
+            REQUIRE(echo == packet.size());
+        }
+        const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() - begin
+        ).count();
+        const auto cpuDuration = static_cast<double>(std::clock() - cpuBegin) / CLOCKS_PER_SEC * 1e6;
+        stream.stop();
+        std::sort(latencies.begin(), latencies.end());
+        std::cout
+            << (busyPoll ? "busy polling" : "sleeping")
+            << ": median round-trip latency " << latencies[latencies.size() / 2] << " us"
+            << ", 99th percentile " << latencies[latencies.size() * 99 / 100] << " us"
+            << ", CPU usage " << cpuDuration / duration * 100 << " %"
+            << std::endl;
+    }
+}
+
+TEST_CASE("Connect to the chip with the given id and monitor its statistics", "[DriverGuard, Chip]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("reader");
+    auto readBytes = static_cast<std::size_t>(0);
+    auto readTransfers = static_cast<std::size_t>(0);
+    while (readBytes < static_cast<std::size_t>(1e6)) {
+        readBytes += chip.read().size();
+        ++readTransfers;
+    }
+    const auto statistics = chip.statistics();
+    REQUIRE(statistics.bytesRead == readBytes);
+    REQUIRE(statistics.readTransfers == readTransfers);
+    REQUIRE(std::accumulate(statistics.readLatencies.begin(), statistics.readLatencies.end(), static_cast<uint64_t>(0)) == readTransfers);
+    std::cout
+        << "Status-only reads: " << statistics.statusOnlyReads
+        << ", short packets: " << statistics.shortPackets
+        << ", timeouts: " << statistics.timeouts << std::endl;
+}
+
+TEST_CASE("Connect to the chip with the given id and monitor the status bytes", "[DriverGuard, Chip]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("reader");
+    auto handledOverruns = static_cast<std::size_t>(0);
+    chip.setOverrunHandler([&](coyote::ReadStatus) {
+        ++handledOverruns;
+    });
+    auto overruns = static_cast<std::size_t>(0);
+    auto readBytes = static_cast<std::size_t>(0);
+    while (readBytes < static_cast<std::size_t>(10e6)) {
+        auto status = coyote::ReadStatus{};
+        readBytes += chip.read(status).size();
+        if (status.overrun()) {
+            ++overruns;
+        }
+    }
+    REQUIRE(handledOverruns == overruns);
+    REQUIRE(chip.statistics().overruns == overruns);
+    std::cout << "Overruns: " << overruns << std::endl;
+}
+
+TEST_CASE("Store bytes in a device buffer", "[DeviceBuffer]") {
+    coyote::DeviceBuffer buffer(nullptr, 16);
+    REQUIRE_FALSE(buffer.deviceMemory());
+    REQUIRE(buffer.capacity() == 16);
+    auto bytes = std::vector<uint8_t>(12);
+    std::iota(bytes.begin(), bytes.end(), 0);
+    buffer.append(bytes.data(), bytes.size());
+    buffer.consume(5);
+    REQUIRE(buffer.size() == 7);
+    REQUIRE(std::equal(std::next(bytes.begin(), 5), bytes.end(), buffer.data()));
+    auto movedBuffer = std::move(buffer);
+    REQUIRE(movedBuffer.size() == 7);
+    REQUIRE(buffer.empty());
+    REQUIRE(buffer.capacity() == 0);
+}
+
+TEST_CASE("Move bytes through a ring", "[Ring]") {
+    coyote::Ring ring(16);
+    auto bytes = std::vector<uint8_t>(12);
+    std::iota(bytes.begin(), bytes.end(), 0);
+    REQUIRE(ring.writable() == 16);
+    ring.write(bytes.data(), bytes.size());
+    REQUIRE(ring.readable() == 0);
+    ring.commit();
+    REQUIRE(ring.readable() == 12);
+    ring.pop(8);
+    ring.write(bytes.data(), bytes.size());
+    ring.commit();
+    REQUIRE(ring.writable() == 0);
+    auto peeked = std::vector<uint8_t>(16);
+    ring.peek(peeked.data(), 0, peeked.size());
+    REQUIRE(std::equal(std::next(bytes.begin(), 8), bytes.end(), peeked.begin()));
+    REQUIRE(std::equal(bytes.begin(), bytes.end(), std::next(peeked.begin(), 4)));
+}
+
+TEST_CASE("Connect to the chip with the given id and record its bytes", "[DriverGuard, Chip, Recorder]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("reader");
+    auto options = coyote::RecorderOptions();
+    options.direct = true;
+    const TemporaryFile capture;
+    const auto begin = std::chrono::high_resolution_clock::now();
+    coyote::Recorder recorder(chip, capture.path(), options);
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    recorder.stop();
+    const auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - begin).count();
+    const auto statistics = recorder.statistics();
+    REQUIRE(statistics.drops == 0);
+    REQUIRE(statistics.writtenBytes > statistics.recordedBytes);
+    std::cout << "Recording bitrate: " << statistics.recordedBytes / static_cast<double>(duration) << " MB/s" << std::endl;
+}
+
+TEST_CASE("Replay a capture file and record it again", "[ReplayChip, Recorder]") {
+    const TemporaryFile replay;
+    const TemporaryFile capture;
+    writeCapture(replay.path(), {{0, std::vector<uint8_t>(4, 0)}, {10, std::vector<uint8_t>(4, 1)}, {20, std::vector<uint8_t>(4, 2)}});
+    {
+        coyote::ReplayChip replayChip(replay.path());
+        for (uint8_t index = 0; index < 3; ++index) {
+            const auto record = replayChip.next();
+            REQUIRE(record.timestamp == index * 10);
+            REQUIRE(std::vector<uint8_t>(record.begin, record.end) == std::vector<uint8_t>(4, index));
+        }
+        REQUIRE(replayChip.finished());
+        REQUIRE(replayChip.read().empty());
+    }
+    {
+        coyote::ReplayChip replayChip(replay.path());
+        auto options = coyote::RecorderOptions();
+        options.ringSize = 1 << 20;
+        options.preallocation = 1 << 20;
+        coyote::Recorder recorder(replayChip, capture.path(), options);
+        while (recorder.statistics().recordedBytes < 12) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        recorder.stop();
+    }
+    {
+        coyote::ReplayChip replayChip(capture.path(), true, true);
+        for (uint8_t index = 0; index < 6; ++index) {
+            REQUIRE(replayChip.read() == std::vector<uint8_t>(4, index % 3));
+        }
+        REQUIRE(!replayChip.finished());
+    }
+}
+
+TEST_CASE("Play a file to a replay chip", "[ReplayChip, Player]") {
+    const TemporaryFile replay;
+    const TemporaryFile play;
+    writeCapture(replay.path(), {});
+    {
+        auto file = std::ofstream(play.path(), std::ofstream::binary);
+        const auto bytes = std::vector<char>(1000000);
+        file.write(bytes.data(), bytes.size());
+    }
+    coyote::ReplayChip replayChip(replay.path());
+    {
+        coyote::Player player(replayChip, play.path());
+        const auto report = player.play();
+        REQUIRE(report.bytes == 1000000);
+        REQUIRE(replayChip.statistics().bytesWritten == 1000000);
+        REQUIRE(replayChip.statistics().writeTransfers == 16);
+    }
+    {
+        auto options = coyote::PlayerOptions();
+        options.rate = 10e6;
+        coyote::Player player(replayChip, play.path(), options);
+        const auto report = player.play();
+        REQUIRE(report.bytes == 1000000);
+        REQUIRE(report.duration > 0.09);
+    }
+}
+
+/// FailingReplayChip throws from the given submitWrite call, and from the handleEvents call which follows.
+class FailingReplayChip : public coyote::ReplayChip {
+    public:
+        FailingReplayChip(const std::string& filename, std::size_t failingSubmission) :
+            coyote::ReplayChip(filename),
+            _failingSubmission(failingSubmission),
+            _submissions(0),
+            _failed(false)
+        {
+        }
+
+        virtual void submitWrite(
+            const uint8_t* bytes,
+            std::size_t size,
+            std::function<void(libusb_transfer_status, std::size_t)> handler
+        ) override {
+            ++_submissions;
+            if (_submissions == _failingSubmission) {
+                _failed = true;
+                throw std::runtime_error("submitting a transfer failed");
+            }
+            coyote::ReplayChip::submitWrite(bytes, size, std::move(handler));
+        }
+
+        virtual void handleEvents(uint32_t timeout) override {
+            if (_failed) {
+                _failed = false;
+                throw std::runtime_error("handling events failed");
+            }
+            coyote::ReplayChip::handleEvents(timeout);
+        }
+
+    protected:
+        const std::size_t _failingSubmission;
+        std::size_t _submissions;
+        bool _failed;
+};
+
+TEST_CASE("Wait for the transfers in flight when playing fails", "[ReplayChip, Player]") {
+    const TemporaryFile replay;
+    const TemporaryFile play;
+    writeCapture(replay.path(), {});
+    {
+        auto file = std::ofstream(play.path(), std::ofstream::binary);
+        const auto bytes = std::vector<char>(1000000);
+        file.write(bytes.data(), bytes.size());
+    }
+    FailingReplayChip chip(replay.path(), 3);
+    {
+        coyote::Player player(chip, play.path());
+        REQUIRE_THROWS_WITH(player.play(), "submitting a transfer failed");
+    }
+
+    // the handlers of the two transfers submitted before the failure have been called
+    REQUIRE(chip.nextTimeout() == -1);
+    REQUIRE(chip.statistics().writeTransfers == 2);
+}
+
+TEST_CASE("Connect to the chip with the given id and monitor the playing performance", "[DriverGuard, Chip, Player]") {
+    const auto driverGuard = coyote::DriverGuard();
+    auto chip = coyote::Chip("writer");
+    const TemporaryFile play;
+    {
+        auto file = std::ofstream(play.path(), std::ofstream::binary);
+        const auto bytes = std::vector<char>(static_cast<std::size_t>(100e6));
+        file.write(bytes.data(), bytes.size());
+    }
+    coyote::Player player(chip, play.path());
+    const auto report = player.play();
+    std::cout << "Playing bitrate: " << report.throughput / 1e6 << " MB/s, underruns: " << report.underruns << std::endl;
+}
+
+TEST_CASE("Split bytes into records", "[Framer]") {
+    {
+        coyote::Framer framer(coyote::RecordDescriptor::fixed(3));
+        auto records = std::vector<std::vector<uint8_t>>();
+        const auto handleRecord = [&](const uint8_t* begin, const uint8_t* end) {
+            records.emplace_back(begin, end);
+        };
+        const auto bytes = std::vector<uint8_t>({0, 1, 2, 3, 4, 5, 6, 7});
+        framer.push(bytes.data(), bytes.data() + 4, handleRecord);
+        REQUIRE(records.size() == 1);
+        REQUIRE(framer.pending() == 1);
+        framer.push(bytes.data() + 4, bytes.data() + 5, handleRecord);
+        framer.push(bytes.data() + 5, bytes.data() + bytes.size(), handleRecord);
+        REQUIRE(records == std::vector<std::vector<uint8_t>>({{0, 1, 2}, {3, 4, 5}}));
+        REQUIRE(framer.pending() == 2);
+    }
+    {
+        coyote::Framer framer(coyote::RecordDescriptor::lengthPrefixed(1, 2, 3, true, 16));
+        auto records = std::vector<std::vector<uint8_t>>();
+        const auto handleRecord = [&](const uint8_t* begin, const uint8_t* end) {
+            records.emplace_back(begin, end);
+        };
+        const auto bytes = std::vector<uint8_t>({0xa0, 0, 2, 1, 2, 0xa1, 0, 0, 0xa2, 0, 1, 3});
+        for (std::size_t index = 0; index < bytes.size(); ++index) {
+            framer.push(bytes.data() + index, bytes.data() + index + 1, handleRecord);
+        }
+        REQUIRE(records == std::vector<std::vector<uint8_t>>({{0xa0, 0, 2, 1, 2}, {0xa1, 0, 0}, {0xa2, 0, 1, 3}}));
+        REQUIRE(framer.pending() == 0);
+        const auto corrupted = std::vector<uint8_t>({0xa3, 0xff, 0xff});
+        REQUIRE_THROWS(framer.push(corrupted.data(), corrupted.data() + corrupted.size(), handleRecord));
+
+        // a corrupted header completed by a later push is discarded as well
+        framer.push(corrupted.data(), corrupted.data() + 1, handleRecord);
+        REQUIRE_THROWS(framer.push(corrupted.data() + 1, corrupted.data() + corrupted.size(), handleRecord));
+        REQUIRE(framer.pending() == 0);
+        framer.push(bytes.data(), bytes.data() + 5, handleRecord);
+        REQUIRE(records.back() == std::vector<uint8_t>({0xa0, 0, 2, 1, 2}));
+    }
+}
+
+TEST_CASE("Dispatch the records of a replay chip to channels", "[ReplayChip, Demultiplexer]") {
+    const TemporaryFile replay;
+    auto records = std::vector<TestRecord>();
+    for (uint8_t index = 0; index < 100; ++index) {
+        records.push_back(TestRecord{0, {static_cast<uint8_t>(index % 3), 4, 0, index, index}});
+    }
+    writeCapture(replay.path(), records);
+    coyote::ReplayChip replayChip(replay.path());
+    coyote::Demultiplexer demultiplexer(replayChip, coyote::RecordDescriptor::lengthPrefixed(1, 2, 1), 0);
+    auto events = std::vector<uint8_t>();
+    auto telemetry = std::vector<uint8_t>();
+    demultiplexer.addChannel(0, [&](const uint8_t* begin, const uint8_t*) {
+        events.push_back(begin[3]);
+    }, coyote::Overflow::block);
+    demultiplexer.addChannel(1, [&](const uint8_t* begin, const uint8_t*) {
+        telemetry.push_back(begin[3]);
+    });
+    demultiplexer.start();
+    while (replayChip.statistics().bytesRead < 500) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    demultiplexer.stop();
+    REQUIRE(events.size() == 34);
+    REQUIRE(telemetry.size() == 33);
+    REQUIRE(demultiplexer.unroutedRecords() == 33);
+    REQUIRE(demultiplexer.statistics(0).bytes == 34 * 5);
+    for (std::size_t index = 0; index < events.size(); ++index) {
+        REQUIRE(events[index] == index * 3);
+    }
+}
+
+TEST_CASE("Drop the records larger than a blocking channel's ring", "[ReplayChip, Demultiplexer]") {
+    const TemporaryFile replay;
+    auto large = std::vector<uint8_t>(20, 1);
+    large[0] = 0;
+    large[1] = 19;
+    large[2] = 0;
+    writeCapture(replay.path(), {{0, large}, {0, {0, 4, 0, 2, 2}}});
+    coyote::ReplayChip replayChip(replay.path());
+    coyote::Demultiplexer demultiplexer(replayChip, coyote::RecordDescriptor::lengthPrefixed(1, 2, 1), 0);
+    auto records = std::vector<std::vector<uint8_t>>();
+    demultiplexer.addChannel(0, [&](const uint8_t* begin, const uint8_t* end) {
+        records.emplace_back(begin, end);
+    }, coyote::Overflow::block, 16);
+    demultiplexer.start();
+    while (replayChip.statistics().bytesRead < 25) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    demultiplexer.stop();
+    REQUIRE(records == std::vector<std::vector<uint8_t>>({{0, 4, 0, 2, 2}}));
+    REQUIRE(demultiplexer.statistics(0).droppedRecords == 1);
+}
+
+/// GatedReplayChip stores the written bytes, and blocks the first write until the gate is opened.
+class GatedReplayChip : public coyote::ReplayChip {
+    public:
+        GatedReplayChip(const std::string& filename) :
+            coyote::ReplayChip(filename),
+            _gate(_promise.get_future().share())
+        {
+        }
+
+        virtual void write(const std::vector<uint8_t>& bytes, bool) override {
+            _gate.wait();
+            std::lock_guard<std::mutex> lock(_mutex);
+            _writes.push_back(bytes);
+        }
+
+        void open() {
+            _promise.set_value();
+        }
+
+        std::vector<std::vector<uint8_t>> writes() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _writes;
+        }
+
+    protected:
+        std::promise<void> _promise;
+        std::shared_future<void> _gate;
+        std::mutex _mutex;
+        std::vector<std::vector<uint8_t>> _writes;
+};
+
+TEST_CASE("Schedule messages from several lanes", "[ReplayChip, WriteScheduler]") {
+    const TemporaryFile replay;
+    writeCapture(replay.path(), {});
+    GatedReplayChip chip(replay.path());
+    coyote::WriteScheduler writeScheduler(chip, 16, 4);
+    writeScheduler.addLane("upload", 1);
+    writeScheduler.addLane("bias", 2);
+    writeScheduler.addLane("stop", 0, 1);
+    writeScheduler.send("upload", std::vector<uint8_t>(16, 0));
+    while (writeScheduler.statistics("upload").messages == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (std::size_t index = 0; index < 4; ++index) {
+        writeScheduler.send("upload", std::vector<uint8_t>(8, 1));
+        writeScheduler.send("bias", std::vector<uint8_t>(4, 2));
+    }
+    writeScheduler.send("stop", std::vector<uint8_t>(2, 3));
+    chip.open();
+    writeScheduler.flush();
+    const auto writes = chip.writes();
+    REQUIRE(writes.size() == 5);
+    REQUIRE(writes[0] == std::vector<uint8_t>(16, 0));
+
+    // the upload lane's debt (16 bytes sent with a 4 bytes credit) lets the bias lane go first
+    REQUIRE(writes[1] == std::vector<uint8_t>({3, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2}));
+    REQUIRE(writes[2] == std::vector<uint8_t>({2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}));
+    REQUIRE(writes[3] == std::vector<uint8_t>(16, 1));
+    REQUIRE(writes[4] == std::vector<uint8_t>(2, 1));
+    REQUIRE(writeScheduler.statistics("bias").bytes == 16);
+    REQUIRE(writeScheduler.statistics("upload").queuedBytes == 0);
+    writeScheduler.stop();
+}
+
+TEST_CASE("Send an urgent message queued behind a large upload with the next transfer", "[ReplayChip, WriteScheduler]") {
+    const TemporaryFile replay;
+    writeCapture(replay.path(), {});
+    GatedReplayChip chip(replay.path());
+    coyote::WriteScheduler writeScheduler(chip);
+    writeScheduler.addLane("upload", 1);
+    writeScheduler.addLane("stop", 0, 1);
+    writeScheduler.send("upload", std::vector<uint8_t>(4 << 20, 1));
+    while (writeScheduler.statistics("upload").bytes == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    writeScheduler.send("stop", std::vector<uint8_t>(2, 3));
+    chip.open();
+    writeScheduler.flush();
+    const auto writes = chip.writes();
+    REQUIRE(writes.size() == 65);
+    REQUIRE(writes[0] == std::vector<uint8_t>(65536, 1));
+    REQUIRE(writes[1].size() == 65536);
+    REQUIRE(std::vector<uint8_t>(writes[1].begin(), std::next(writes[1].begin(), 3)) == std::vector<uint8_t>({3, 3, 1}));
+    REQUIRE(writes[64] == std::vector<uint8_t>(2, 1));
+    REQUIRE(writeScheduler.statistics("upload").messages == 1);
+    REQUIRE(writeScheduler.statistics("upload").bytes == 4 << 20);
+    writeScheduler.stop();
+}
+
+/// StreamReplayChip stores the bytes and the sizes of the transfers sent by the write buffer.
+/// If gated is true, the first transfer blocks until the gate is opened.
+/// Transfers time out once the budget set with setBudget has been consumed.
+class StreamReplayChip : public coyote::ReplayChip {
+    public:
+        StreamReplayChip(const std::string& filename, bool gated = false) :
+            coyote::ReplayChip(filename),
+            _gated(gated),
+            _gate(_promise.get_future().share()),
+            _budget(std::numeric_limits<std::size_t>::max())
+        {
+        }
+
+        void setBudget(std::size_t budget) {
+            _budget = budget;
+        }
+
+        void open() {
+            _promise.set_value();
+        }
+
+        const std::vector<uint8_t>& stream() const {
+            return _stream;
+        }
+
+        const std::vector<std::size_t>& transfers() const {
+            return _transfers;
+        }
+
+    protected:
+        virtual coyote::WriteResult transferOut(const uint8_t* bytes, std::size_t size) override {
+            if (_gated) {
+                _gate.wait();
+            }
+            const auto sent = std::min(size, _budget);
+            _budget -= sent;
+            _stream.insert(_stream.end(), bytes, bytes + sent);
+            _transfers.push_back(sent);
+            coyote::ReplayChip::transferOut(bytes, sent);
+            return coyote::WriteResult{sent, sent == size ? LIBUSB_SUCCESS : LIBUSB_ERROR_TIMEOUT};
+        }
+
+        const bool _gated;
+        std::promise<void> _promise;
+        std::shared_future<void> _gate;
+        std::vector<uint8_t> _stream;
+        std::vector<std::size_t> _transfers;
+        std::size_t _budget;
+};
+
+TEST_CASE("Write to a replay chip from several threads", "[ReplayChip]") {
+    const TemporaryFile replay;
+    writeCapture(replay.path(), {});
+    StreamReplayChip chip(replay.path());
+    const auto threadsCount = static_cast<std::size_t>(8);
+    const auto messagesCount = static_cast<std::size_t>(1000);
+    auto threads = std::vector<std::thread>();
+    auto expectedBytes = static_cast<std::size_t>(0);
+    for (std::size_t thread = 0; thread < threadsCount; ++thread) {
+        for (std::size_t message = 0; message < messagesCount; ++message) {
+            expectedBytes += 3 + (thread * 37 + message * 11) % 1000;
+        }
+        threads.emplace_back([&chip, thread, messagesCount]() {
+            for (std::size_t message = 0; message < messagesCount; ++message) {
+
+                // each message holds the thread index, a 16 bits length and a payload filled with the message index
+                const auto size = (thread * 37 + message * 11) % 1000;
+                auto bytes = std::vector<uint8_t>(3 + size, static_cast<uint8_t>(message & 0xff));
+                bytes[0] = static_cast<uint8_t>(thread);
+                bytes[1] = static_cast<uint8_t>(size & 0xff);
+                bytes[2] = static_cast<uint8_t>(size >> 8);
+                chip.write(bytes, message % 3 == 0);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    chip.write(std::vector<uint8_t>());
+    const auto& stream = chip.stream();
+    REQUIRE(stream.size() == expectedBytes);
+    REQUIRE(chip.statistics().bytesWritten == expectedBytes);
+    auto nextMessages = std::vector<std::size_t>(threadsCount, 0);
+    for (auto begin = stream.begin(); begin != stream.end();) {
+        const auto thread = static_cast<std::size_t>(begin[0]);
+        REQUIRE(thread < threadsCount);
+        const auto message = nextMessages[thread];
+        const auto size = static_cast<std::size_t>(begin[1]) | (static_cast<std::size_t>(begin[2]) << 8);
+        REQUIRE(size == (thread * 37 + message * 11) % 1000);
+        REQUIRE(std::all_of(std::next(begin, 3), std::next(begin, 3 + size), [message](uint8_t byte) {
+            return byte == static_cast<uint8_t>(message & 0xff);
+        }));
+        ++nextMessages[thread];
+        std::advance(begin, 3 + size);
+    }
+    REQUIRE(std::all_of(nextMessages.begin(), nextMessages.end(), [messagesCount](std::size_t messages) {
+        return messages == messagesCount;
+    }));
+}
+
+TEST_CASE("Combine the writes of several threads into one transfer", "[ReplayChip]") {
+    const TemporaryFile replay;
+    writeCapture(replay.path(), {});
+    StreamReplayChip chip(replay.path(), true);
+    auto first = std::thread([&chip]() {
+        chip.write(std::vector<uint8_t>(1, 0));
+    });
+    while (chip.statistics().bufferedBytes == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto threads = std::vector<std::thread>();
+    for (std::size_t thread = 0; thread < 8; ++thread) {
+        threads.emplace_back([&chip, thread]() {
+            chip.write(std::vector<uint8_t>(10, static_cast<uint8_t>(thread + 1)));
+        });
+    }
+
+    // the bytes of a write call are pending once its request is queued, hence the 8 requests are queued behind the first write
+    while (chip.statistics().pendingBytes < 81) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    chip.open();
+    first.join();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    REQUIRE(chip.transfers() == std::vector<std::size_t>({1, 80}));
+    REQUIRE(chip.statistics().writeTransfers == 2);
+    REQUIRE(chip.statistics().pendingBytes == 0);
+}
+
+TEST_CASE("Resume a write after a failed transfer", "[ReplayChip]") {
+    const TemporaryFile replay;
+    writeCapture(replay.path(), {});
+    StreamReplayChip chip(replay.path());
+    auto bytes = std::vector<uint8_t>(200000);
+    std::iota(bytes.begin(), bytes.end(), 0);
+    chip.setBudget(100000);
+    auto result = chip.tryWrite(bytes);
+    REQUIRE_FALSE(result.complete());
+    REQUIRE(result.error == LIBUSB_ERROR_TIMEOUT);
+    REQUIRE(result.accepted == 100000);
+    chip.setBudget(std::numeric_limits<std::size_t>::max());
+    result = chip.tryWrite(bytes, true, result.accepted);
+    REQUIRE(result.complete());
+    REQUIRE(result.accepted == bytes.size());
+    REQUIRE(chip.stream() == bytes);
+
+    // the buffered bytes which could not be sent are kept in the write buffer
+    chip.write(std::vector<uint8_t>(10, 1), false);
+    chip.setBudget(4);
+    REQUIRE_THROWS(chip.write(std::vector<uint8_t>()));
+    REQUIRE(chip.statistics().bufferedBytes == 6);
+    chip.setBudget(std::numeric_limits<std::size_t>::max());
+    chip.write(std::vector<uint8_t>());
+    REQUIRE(chip.stream().size() == 200010);
+    REQUIRE(std::all_of(std::next(chip.stream().begin(), 200000), chip.stream().end(), [](uint8_t byte) {
+        return byte == 1;
+    }));
+    REQUIRE(chip.statistics().bufferedBytes == 0);
+}
+
+TEST_CASE("Read from a replay chip with an event loop", "[ReplayChip]") {
+    const TemporaryFile replay;
+    auto records = std::vector<TestRecord>();
+    for (uint8_t index = 0; index < 10; ++index) {
+        records.push_back(TestRecord{0, {index, index}});
+    }
+    writeCapture(replay.path(), records);
+    coyote::ReplayChip chip(replay.path());
+    REQUIRE(chip.pollfds().empty());
+    REQUIRE(chip.nextTimeout() == -1);
+    auto bytes = std::vector<uint8_t>();
+    std::function<void(libusb_transfer_status, const std::vector<uint8_t>&, coyote::ReadStatus)> onRead;
+    onRead = [&](libusb_transfer_status status, const std::vector<uint8_t>& readBytes, coyote::ReadStatus) {
+        REQUIRE(status == LIBUSB_TRANSFER_COMPLETED);
+        bytes.insert(bytes.end(), readBytes.begin(), readBytes.end());
+        if (!chip.finished()) {
+            chip.submitRead(onRead);
+        }
+    };
+    chip.submitRead(onRead);
+    REQUIRE(chip.nextTimeout() == 0);
+    while (chip.nextTimeout() == 0) {
+        chip.processEvents();
+    }
+    REQUIRE(bytes.size() == 20);
+    for (std::size_t index = 0; index < bytes.size(); ++index) {
+        REQUIRE(bytes[index] == index / 2);
+    }
+}
+
+TEST_CASE("Stream the records of a replay chip", "[ReplayChip, Stream]") {
+    const TemporaryFile replay;
+    auto records = std::vector<TestRecord>();
+    for (std::size_t index = 0; index < 1000; ++index) {
+        records.push_back(TestRecord{0, {static_cast<uint8_t>(index & 0xff), static_cast<uint8_t>(index >> 8), 0}});
+    }
+    writeCapture(replay.path(), records);
+    coyote::ReplayChip chip(replay.path());
+    auto options = coyote::StreamOptions();
+    options.transfers = 4;
+    options.chunks = 8;
+    coyote::Stream stream(chip, options);
+    for (std::size_t index = 0; index < 1000; ++index) {
+        const auto chunk = stream.next();
+        REQUIRE(chunk.end - chunk.begin == 3);
+        REQUIRE((static_cast<std::size_t>(chunk.begin[0]) | (static_cast<std::size_t>(chunk.begin[1]) << 8)) == index);
+    }
+    stream.stop();
+
+    // the consumed file yields empty records, which are not returned
+    REQUIRE(stream.next().begin == nullptr);
+    options.transfers = 8;
+    REQUIRE_THROWS([&]() {
+        coyote::Stream invalidStream(chip, options);
+    }());
+}
+
+TEST_CASE("Stream the records of a replay chip with busy polling", "[ReplayChip, Stream]") {
+    const TemporaryFile replay;
+    auto records = std::vector<TestRecord>();
+    for (std::size_t index = 0; index < 1000; ++index) {
+        records.push_back(TestRecord{0, {static_cast<uint8_t>(index & 0xff), static_cast<uint8_t>(index >> 8)}});
+    }
+    writeCapture(replay.path(), records);
+    coyote::ReplayChip chip(replay.path());
+    auto options = coyote::StreamOptions();
+    options.transfers = 4;
+    options.chunks = 8;
+    options.busyPoll = true;
+    options.idleTimeout = std::chrono::milliseconds(20);
+    coyote::Stream stream(chip, options);
+    for (std::size_t index = 0; index < 1000; ++index) {
+        const auto chunk = stream.next();
+        REQUIRE(chunk.end - chunk.begin == 2);
+        REQUIRE((static_cast<std::size_t>(chunk.begin[0]) | (static_cast<std::size_t>(chunk.begin[1]) << 8)) == index);
+    }
+
+    // the consumed file yields empty records, hence next spins until the idle timeout
+    const auto begin = std::chrono::steady_clock::now();
+    const auto idle = stream.next();
+    REQUIRE(std::chrono::steady_clock::now() - begin >= std::chrono::milliseconds(20));
+    REQUIRE(idle.begin != nullptr);
+    REQUIRE(idle.begin == idle.end);
+    stream.stop();
+    REQUIRE(stream.next().begin == nullptr);
+}
+
+TEST_CASE("Adapt the transfer size of a stream to the arrival rate", "[ReplayChip, Stream]") {
+    const TemporaryFile replay;
+    auto records = std::vector<TestRecord>();
+    for (std::size_t index = 0; index < 520; ++index) {
+
+        // 500 large records without delay after 50 ms, then 20 small records every 5 ms
+        // the first records are delayed so that the initial transfer size is checked before any completion
+        records.push_back(TestRecord{
+            static_cast<uint64_t>(50000000 + (index < 500 ? 0 : (index - 499) * 5000000)),
+            std::vector<uint8_t>(index < 500 ? 16384 : 3, static_cast<uint8_t>(index & 0xff)),
+        });
+    }
+    writeCapture(replay.path(), records);
+    coyote::ReplayChip chip(replay.path(), true);
+    auto options = coyote::StreamOptions();
+    options.adaptive = true;
+    options.smoothing = 0.5;
+    coyote::Stream stream(chip, options);
+    REQUIRE(stream.transferSize() == chip.packetSize());
+    auto largestTransferSize = static_cast<std::size_t>(0);
+    for (std::size_t index = 0; index < 520; ++index) {
+        const auto chunk = stream.next();
+        REQUIRE(chunk.end - chunk.begin == (index < 500 ? 16384 : 3));
+        largestTransferSize = std::max(largestTransferSize, stream.transferSize());
+    }
+    stream.stop();
+    REQUIRE(largestTransferSize == chip.transferSize());
+    REQUIRE(stream.transferSize() == chip.packetSize());
+    options.minimumTransferSize = chip.transferSize() * 2;
+    REQUIRE_THROWS([&]() {
+        coyote::Stream invalidStream(chip, options);
+    }());
+}
+
+TEST_CASE("Absorb the empty transfers of a stream", "[ReplayChip, Stream]") {
+    const TemporaryFile replay;
+    auto records = std::vector<TestRecord>();
+    for (uint8_t index = 0; index < 10; ++index) {
+
+        // one record out of two is empty, as a status-only transfer
+        records.push_back(TestRecord{0, std::vector<uint8_t>(index % 2 == 0 ? 3 : 0, index)});
+    }
+    writeCapture(replay.path(), records);
+    coyote::ReplayChip chip(replay.path());
+    auto options = coyote::StreamOptions();
+    options.idleTimeout = std::chrono::milliseconds(20);
+    coyote::Stream stream(chip, options);
+    for (uint8_t index = 0; index < 10; index += 2) {
+        const auto chunk = stream.next();
+        REQUIRE(chunk.end - chunk.begin == 3);
+        REQUIRE(chunk.begin[0] == index);
+    }
+
+    // the consumed file yields empty records, which are absorbed until the idle timeout
+    const auto begin = std::chrono::steady_clock::now();
+    const auto chunk = stream.next();
+    REQUIRE(chunk.begin != nullptr);
+    REQUIRE(chunk.begin == chunk.end);
+    REQUIRE(std::chrono::steady_clock::now() - begin >= std::chrono::milliseconds(20));
+    REQUIRE(stream.emptyCompletions() > 5);
+    stream.stop();
+}
+
+TEST_CASE("Stamp the transfers of a replay chip", "[ReplayChip, Stream]") {
+    const TemporaryFile replay;
+    auto records = std::vector<TestRecord>();
+    for (uint8_t index = 0; index < 10; ++index) {
+        records.push_back(TestRecord{0, {index}});
+    }
+    writeCapture(replay.path(), records);
+    coyote::ReplayChip chip(replay.path());
+    const auto begin = coyote::ReadStatus::clockTime(CLOCK_MONOTONIC);
+    auto status = coyote::ReadStatus{};
+    chip.read(status);
+    REQUIRE(status.sequence == 0);
+    REQUIRE(status.monotonicTimestamp >= begin);
+    REQUIRE(status.monotonicTimestamp <= coyote::ReadStatus::clockTime(CLOCK_MONOTONIC));
+    REQUIRE(status.realtimeTimestamp > 0);
+    auto previousTimestamp = status.monotonicTimestamp;
+    coyote::Stream stream(chip);
+    for (uint64_t sequence = 1; sequence < 10; ++sequence) {
+        const auto chunk = stream.next();
+        REQUIRE(chunk.begin[0] == sequence);
+        REQUIRE(chunk.status.sequence == sequence);
+        REQUIRE(chunk.status.monotonicTimestamp >= previousTimestamp);
+        previousTimestamp = chunk.status.monotonicTimestamp;
+    }
+    stream.stop();
+}